@@ -1,4 +1,7 @@
 #include "canvas.h"
+#include "heatmap.h"
+#include "layer.h"
+#include "render.h"
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
@@ -6,27 +9,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>	 //memcpy
-#include <unistd.h>	 // usleep
-
-typedef struct CanvasLayer {
-	GLuint size;
-	GLenum format;
-	GLuint tex;
-	GLuint pbo1;
-	GLuint pbo2;
-	GLubyte* data;
-	size_t mem;
-} CanvasLayer;
 
 // Global state
 
 static int canvas_display = -1;
-static unsigned int canvas_tex_size = 1024;
 static int canvas_width = 0;
 static int canvas_height = 0;
 static GLFWwindow* canvas_win;
-static CanvasLayer* canvas_base;
-static CanvasLayer* canvas_overlay;
 
 pthread_t canvas_thread;
 
@@ -34,10 +23,6 @@ void glfw_error_callback(int error, const char* description) {
 	printf("GLFW Error: %d %s", error, description);
 }
 
-static inline int min(int a, int b) { return a < b ? a : b; }
-
-static inline int max(int a, int b) { return a > b ? a : b; }
-
 // User callbacks
 
 void (*canvas_on_close_cb)();
@@ -45,23 +30,28 @@ void (*canvas_on_resize_cb)();
 void (*canvas_on_key_cb)(int, int, int);
 
 static int canvas_do_layout = 0;
-
-static CanvasLayer* canvas_layer_alloc(int size, int alpha) {
-	CanvasLayer* layer = malloc(sizeof(CanvasLayer));
-	layer->size = size;
-	layer->format = alpha ? GL_RGBA : GL_RGB;
-	layer->mem = size * size * (alpha ? 4 : 3);
-	layer->data = malloc(sizeof(GLubyte) * layer->mem);
-	memset(layer->data, 0, layer->mem);
-	return layer;
-}
+// Set if projection and viewport need to be recalculated (e.g. after a resize)
+static int canvas_do_projection = 1;
+// Set if the next frame must be rendered even if no layer changed (e.g. window was exposed)
+static volatile int canvas_do_redraw = 1;
 
 static void canvas_layer_bind(CanvasLayer* layer) {
-	// Create texture object
+	// Fresh texture objects need a full upload
+	canvas_layer_touch(layer);
+
+	// Create texture object. Storage is allocated once, updates only replace parts of it.
 	glGenTextures(1, &(layer->tex));
 	glBindTexture(GL_TEXTURE_2D, layer->tex);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	if (GLEW_ARB_texture_storage) {
+		glTexStorage2D(GL_TEXTURE_2D, 1, layer->alpha ? GL_RGBA8 : GL_RGB8, layer->width,
+									 layer->height);
+	} else {
+		GLenum format = layer->alpha ? GL_RGBA : GL_RGB;
+		glTexImage2D(GL_TEXTURE_2D, 0, layer->alpha ? GL_RGBA8 : GL_RGB8, layer->width, layer->height,
+								 0, format, GL_UNSIGNED_BYTE, NULL);
+	}
 	glBindTexture(GL_TEXTURE_2D, 0);
 
 	// Create two PBOs
@@ -79,15 +69,10 @@ static void canvas_layer_unbind(CanvasLayer* layer) {
 		glDeleteTextures(1, &(layer->tex));
 		glDeleteBuffers(1, &(layer->pbo1));
 		glDeleteBuffers(1, &(layer->pbo2));
+		layer->tex = 0;
 	}
 }
 
-static void canvas_layer_free(CanvasLayer* layer) {
-	canvas_layer_unbind(layer);
-	free(layer->data);
-	free(layer);
-}
-
 static void canvas_on_resize(GLFWwindow* window, int w, int h);
 static void canvas_on_key(GLFWwindow* window, int key, int scancode, int action, int mods);
 
@@ -95,9 +80,13 @@ static void canvas_on_key(GLFWwindow* window, int key, int scancode, int action,
 	if (action == GLFW_PRESS && canvas_on_key_cb) (*canvas_on_key_cb)(key, scancode, mods);
 }
 
+static void canvas_on_refresh(GLFWwindow* window) { canvas_do_redraw = 1; }
+
 static void canvas_on_resize(GLFWwindow* window, int w, int h) {
 	canvas_width = w;
 	canvas_height = h;
+	canvas_do_projection = 1;
+	canvas_do_redraw = 1;
 
 	if (canvas_on_resize_cb) (*canvas_on_resize_cb)();
 }
@@ -142,9 +131,10 @@ static void canvas_window_setup() {
 	glEnable(GL_TEXTURE_2D);
 
 	// glfwSetWindowUserPointer(canvas_win, (void*) this);
-	glfwSwapInterval(1);
+	glfwSwapInterval(render_fps == 0);
 	glfwSetKeyCallback(canvas_win, &canvas_on_key);
 	glfwSetFramebufferSizeCallback(canvas_win, &canvas_on_resize);
+	glfwSetWindowRefreshCallback(canvas_win, &canvas_on_refresh);
 
 	glfwGetFramebufferSize(canvas_win, &canvas_width, &canvas_height);
 	canvas_on_resize(canvas_win, canvas_width, canvas_height);
@@ -152,32 +142,74 @@ static void canvas_window_setup() {
 	canvas_do_layout = 0;
 }
 
-static void canvas_draw_layer(CanvasLayer* layer) {
-	if (!layer || !layer->data) return;
-
-	GLuint pboNext = layer->pbo1;
-	GLuint pboIndex = layer->pbo2;
-	layer->pbo1 = pboIndex;
-	layer->pbo2 = pboNext;
+// Push changed rows to the texture. Clean layers are not uploaded at all.
+static void canvas_upload_layer(CanvasLayer* layer) {
+	if (!layer->dirty) return;
+	layer->dirty = 0;
+
+	// Find the range of changed rows. Writers mark rows before the layer, so clearing the layer flag
+	// first never loses an update.
+	unsigned int y1 = 0, y2 = 0;
+	for (unsigned int y = 0; y < layer->height; y++) {
+		if (layer->dirty_rows[y]) {
+			layer->dirty_rows[y] = 0;
+			if (y2 == 0) y1 = y;
+			y2 = y + 1;
+		}
+	}
+	if (y2 == 0) return;
+
+	// Alternate between two PBOs, so we never wait for the driver to finish reading the last one.
+	GLuint pbo = layer->pbo1;
+	layer->pbo1 = layer->pbo2;
+	layer->pbo2 = pbo;
+
+	size_t offset = y1 * layer->stride;
+	size_t len = (y2 - y1) * layer->stride;
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+	GLubyte* ptr = (GLubyte*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, offset, len,
+																						GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+	if (ptr) {
+		memcpy(ptr, layer->data + offset, len);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+		// Rows are padded, so tell GL about the actual row length
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, layer->stride / layer->bpp);
+		glBindTexture(GL_TEXTURE_2D, layer->tex);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y1, layer->width, y2 - y1,
+										layer->alpha ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE, (void*)offset);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
 
-	// Switch PBOs on each call. One is updated, one is drawn.
-	// Update texture from first PBO
-	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pboIndex);
-	glBindTexture(GL_TEXTURE_2D, layer->tex);
-	glTexImage2D(GL_TEXTURE_2D, 0, layer->format, layer->size, layer->size, 0, layer->format,
-							 GL_UNSIGNED_BYTE, 0);
-	glBindTexture(GL_TEXTURE_2D, 0);
+// Projection and scaling only change with the window size, so they are not recalculated per frame.
+static void canvas_update_projection() {
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	glOrtho(0, canvas_width, canvas_height, 0, -1, 1);
+	glViewport(0, 0, (GLsizei)canvas_width, (GLsizei)canvas_height);
+
+	// Scale the canvas to fit the window, keep the aspect ratio and center it.
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
+	float sx = (float)canvas_width / canvas_base->width;
+	float sy = (float)canvas_height / canvas_base->height;
+	float scale = sx < sy ? sx : sy;
+	glTranslatef((canvas_width - canvas_base->width * scale) / 2,
+							 (canvas_height - canvas_base->height * scale) / 2, 0);
+	glScalef(scale, scale, 1);
+
+	canvas_do_projection = 0;
+}
 
-	// Update second PBO with new pixel data
-	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pboNext);
-	GLubyte* ptr = (GLubyte*)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
-	memcpy(ptr, layer->data, layer->mem);
-	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
-	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+static void canvas_draw_layer(CanvasLayer* layer) {
+	if (!layer || !layer->data) return;
 
-	//// Actually draw stuff. The texture should be updated in the meantime.
+	canvas_upload_layer(layer);
 
-	if (layer->format == GL_RGBA) {
+	if (layer->alpha) {
 		glEnable(GL_BLEND);
 		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	} else {
@@ -190,16 +222,45 @@ static void canvas_draw_layer(CanvasLayer* layer) {
 	glTexCoord2f(0, 0);
 	glVertex3f(0.0f, 0.0f, 0.0f);
 	glTexCoord2f(0, 1);
-	glVertex3f(0.0f, layer->size, 0.0f);
+	glVertex3f(0.0f, layer->height, 0.0f);
 	glTexCoord2f(1, 1);
-	glVertex3f(layer->size, layer->size, 0.0f);
+	glVertex3f(layer->width, layer->height, 0.0f);
 	glTexCoord2f(1, 0);
-	glVertex3f(layer->size, 0.0f, 0.0f);
+	glVertex3f(layer->width, 0.0f, 0.0f);
 	glEnd();
 	glBindTexture(GL_TEXTURE_2D, 0);
 	glPopMatrix();
 }
 
+// Debug overlay: Tint each tile red according to its write rate
+static void canvas_draw_heatmap() {
+	glDisable(GL_TEXTURE_2D);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	glBegin(GL_QUADS);
+	for (unsigned int ty = 0; ty < heatmap_tiles_y; ty++) {
+		for (unsigned int tx = 0; tx < heatmap_tiles_x; tx++) {
+			uint8_t a = heatmap_alpha[ty * heatmap_tiles_x + tx];
+			if (!a) continue;
+			float x1 = tx * CANVAS_TILE_SIZE, y1 = ty * CANVAS_TILE_SIZE;
+			float x2 = x1 + CANVAS_TILE_SIZE, y2 = y1 + CANVAS_TILE_SIZE;
+			if (x2 > canvas_base->width) x2 = canvas_base->width;
+			if (y2 > canvas_base->height) y2 = canvas_base->height;
+			glColor4ub(255, 0, 0, a);
+			glVertex3f(x1, y1, 0.0f);
+			glVertex3f(x1, y2, 0.0f);
+			glVertex3f(x2, y2, 0.0f);
+			glVertex3f(x2, y1, 0.0f);
+		}
+	}
+	glEnd();
+
+	// Textures are modulated with the current color
+	glColor4ub(255, 255, 255, 255);
+	glEnable(GL_TEXTURE_2D);
+}
+
 static void* canvas_render_loop(void* arg) {
 	glfwSetErrorCallback(glfw_error_callback);
 	if (!glfwInit()) {
@@ -222,7 +283,8 @@ static void* canvas_render_loop(void* arg) {
 	canvas_layer_bind(canvas_base);
 	canvas_layer_bind(canvas_overlay);
 
-	double last_frame = glfwGetTime();
+	glClearColor(0, 0, 0, 1);
+	double next_frame = render_now();
 
 	while ("pixels are coming") {
 		if (canvas_do_layout) {
@@ -231,58 +293,53 @@ static void* canvas_render_loop(void* arg) {
 			canvas_window_setup();
 			canvas_layer_bind(canvas_base);
 			canvas_layer_bind(canvas_overlay);
+			canvas_do_projection = 1;
 		}
 
 		if (glfwWindowShouldClose(canvas_win)) break;
 
-		glfwGetFramebufferSize(canvas_win, &canvas_width, &canvas_height);
-		glMatrixMode(GL_PROJECTION);
-		glLoadIdentity();
-		glOrtho(0, canvas_width, canvas_height, 0, -1, 1);
-		glViewport(0, 0, (GLsizei)canvas_width, (GLsizei)canvas_height);
-		glClearColor(0, 0, 0, 1);
-		glClear(GL_COLOR_BUFFER_BIT);
-		glPushMatrix();
-
-		GLuint texSize = canvas_base->size;
-		if (canvas_width > texSize || canvas_height > texSize) {
-			float scale = ((float)max(canvas_width, canvas_height)) / (float)texSize;
-			glScalef(scale, scale, 1);
+		// Nothing changed, so the last frame is still valid. Sleep until a writer or an event wakes us.
+		if (render_idle && !canvas_do_redraw && !canvas_base->dirty && !canvas_overlay->dirty) {
+			double since = render_now();
+			glfwWaitEventsTimeout(1.0);
+			render_resume(&next_frame, since);
+			continue;
 		}
 
+		// With vsync, glfwSwapBuffers() blocks until the next display refresh
+		if (render_fps > 0) render_pace(&next_frame, 1.0 / render_fps);
+
+		double start = render_now();
+		canvas_do_redraw = 0;
+
+		if (canvas_do_projection) canvas_update_projection();
+		glClear(GL_COLOR_BUFFER_BIT);
+
 		canvas_draw_layer(canvas_base);
-		// TODO: Overlay is not used yet
-		// canvas_draw_layer(canvas_overlay);
+		canvas_draw_layer(canvas_overlay);
+		if (heatmap_overlay) canvas_draw_heatmap();
 
-		glPopMatrix();
 		glfwPollEvents();
+		render_frame_done(render_now() - start);
 		glfwSwapBuffers(canvas_win);
-
-		double now = glfwGetTime();
-		double dt = now - last_frame;
-		last_frame = now;
-		double sleep = 1.0 / 30 - dt;
-		if (sleep > 0) {
-			usleep(sleep * 1000000);
-		}
 	}
 
 	if (canvas_on_close_cb) (*canvas_on_close_cb)();
 
+	canvas_layer_unbind(canvas_base);
+	canvas_layer_unbind(canvas_overlay);
+	canvas_win = NULL;
 	glfwTerminate();
-	canvas_layer_free(canvas_base);
-	canvas_layer_free(canvas_overlay);
+
+	// The pixel store is not freed, network threads may still be writing to it.
 
 	return NULL;
 }
 
 // Public functions
 
-void canvas_start(unsigned int texSize, void (*on_close)()) {
+void canvas_start(void (*on_close)()) {
 	canvas_on_close_cb = on_close;
-	canvas_tex_size = texSize;
-	canvas_base = canvas_layer_alloc(canvas_tex_size, 0);
-	canvas_overlay = canvas_layer_alloc(canvas_tex_size, 1);
 
 	canvas_render_loop(NULL);
 }
@@ -293,79 +350,25 @@ void canvas_setcb_key(void (*on_key)(int key, int scancode, int mods)) {
 
 void canvas_setcb_resize(void (*on_resize)()) { canvas_on_resize_cb = on_resize; }
 
-void canvas_close() { glfwSetWindowShouldClose(canvas_win, 1); }
-
-void canvas_fullscreen(int display) {
-	canvas_display = display;
-	canvas_do_layout = 1;
-}
-
-int canvas_get_display() { return canvas_display; }
-
-// Return a pointer to the GLubyte for a given pixel, or NULL for out of bound coordinates.
-static inline GLubyte* canvas_offset(CanvasLayer* layer, unsigned int x, unsigned int y) {
-	if (x < 0 || y < 0 || x >= layer->size || y >= layer->size || layer->data == NULL) return NULL;
-	return layer->data + ((y * layer->size) + x) * (layer->format == GL_RGBA ? 4 : 3);
+void canvas_close() {
+	// No window while headless (relay edges) or after the render loop ended
+	if (!canvas_win) return;
+	glfwSetWindowShouldClose(canvas_win, 1);
+	glfwPostEmptyEvent();
 }
 
-void canvas_set_px(unsigned int x, unsigned int y, uint32_t rgba) {
-	CanvasLayer* layer = canvas_base;
-	GLubyte* ptr = canvas_offset(layer, x, y);
-
-	if (ptr == NULL) {
-		return;
-	}
-
-	GLubyte r = (rgba & 0xff000000) >> 24;
-	GLubyte g = (rgba & 0x00ff0000) >> 16;
-	GLubyte b = (rgba & 0x0000ff00) >> 8;
-	GLubyte a = (rgba & 0x000000ff) >> 0;
-
-	if (layer->format == GL_RGBA) {
-		ptr[0] = r;
-		ptr[1] = g;
-		ptr[2] = b;
-		ptr[3] = a;
-		return;
-	}
-	if (a == 0) {
-		return;
-	}
-	if (a < 0xff) {
-		GLuint na = 0xff - a;
-		r = (a * r + na * (ptr[0])) / 0xff;
-		g = (a * g + na * (ptr[1])) / 0xff;
-		b = (a * b + na * (ptr[2])) / 0xff;
-	}
-	ptr[0] = r;
-	ptr[1] = g;
-	ptr[2] = b;
+void canvas_backend_wake() {
+	if (canvas_win && render_idle) glfwPostEmptyEvent();
 }
 
-void canvas_fill(uint32_t rgba) {
-	CanvasLayer* layer = canvas_base;
-	for (int x = 0; x < layer->size; x++)
-		for (int y = 0; y < layer->size; y++) canvas_set_px(x, y, rgba);
+void canvas_backend_redraw() {
+	canvas_do_redraw = 1;
+	if (canvas_win) glfwPostEmptyEvent();
 }
 
-void canvas_get_px(unsigned int x, unsigned int y, uint32_t* rgba) {
-	CanvasLayer* layer = canvas_base;
-	GLubyte* ptr = canvas_offset(layer, x, y);
-	if (ptr == NULL) {
-		*rgba = 0x000000;
-	} else {
-		*rgba = (ptr[0] << 24) + (ptr[1] << 16) + (ptr[2] << 8) + 0xff;
-	}
+void canvas_fullscreen(int display) {
+	canvas_display = display;
+	canvas_do_layout = 1;
 }
 
-void canvas_get_size(unsigned int* w, unsigned int* h) {
-	int texSize = canvas_base->size;
-	if (canvas_width > texSize || canvas_height > texSize) {
-		float scale = ((float)max(canvas_width, canvas_height)) / texSize;
-		*w = min(texSize, canvas_width / scale);
-		*h = min(texSize, canvas_height / scale);
-	} else {
-		*w = canvas_width;
-		*h = canvas_height;
-	}
-}
+int canvas_get_display() { return canvas_display; }
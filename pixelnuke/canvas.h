@@ -1,10 +1,18 @@
 #ifndef CANVAS_H_
 #define CANVAS_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
-// Open the canvas window and start the gui loop (in a separate thread)
-void canvas_start(unsigned int texSize, void (*on_close)());
+// Largest supported canvas width or height
+#define CANVAS_MAX_SIZE 8192
+
+// Allocate the pixel store for a canvas of the given size. Must be called before any other
+// canvas function.
+void canvas_init(unsigned int width, unsigned int height);
+
+// Open the canvas window and run the gui loop until the window is closed.
+void canvas_start(void (*on_close)());
 
 void canvas_setcb_key(void (*on_key)(int key, int scancode, int mods));
 void canvas_setcb_resize(void (*on_resize)());
@@ -12,6 +20,23 @@ void canvas_setcb_resize(void (*on_resize)());
 // Close the canvas window and free any resources and contexts
 void canvas_close();
 
+// Render at a fixed frame rate, or once per display refresh (vsync) if fps is 0.
+void canvas_set_fps(double fps);
+// If enabled, the render loop sleeps while nothing changes instead of redrawing identical frames.
+void canvas_set_idle(int idle);
+
+typedef struct CanvasFrameStats {
+	// Number of frames rendered so far
+	unsigned long frames;
+	// Average and maximum time spent rendering a frame, in seconds. The maximum is reset on each call.
+	double frame_avg;
+	double frame_max;
+	// Current frame rate (0 while idle)
+	double fps;
+} CanvasFrameStats;
+
+void canvas_get_frame_stats(CanvasFrameStats* stats);
+
 void canvas_fullscreen(int display);
 int canvas_get_display();
 
@@ -19,8 +44,24 @@ void canvas_fill(uint32_t rgba);
 void canvas_set_px(unsigned int x, unsigned int y, uint32_t rgba);
 void canvas_get_px(unsigned int x, unsigned int y, uint32_t* rgba);
 
-// get the current visible canvas size in pixel.
-// The actual window might be bigger if scaling is enabled.
+typedef struct CanvasPixel {
+	unsigned int x;
+	unsigned int y;
+	uint32_t rgba;
+} CanvasPixel;
+
+// Same as calling canvas_set_px() for each pixel, but faster for large batches (e.g. binary
+// protocols). Pixels outside of the canvas are skipped.
+void canvas_set_px_batch(const CanvasPixel* px, size_t count);
+
+// Draw to the overlay layer. Overlay pixels are stored as-is (no blending) and composited on top
+// of the base layer, so an alpha value of 0 clears a pixel.
+void canvas_overlay_set_px(unsigned int x, unsigned int y, uint32_t rgba);
+void canvas_overlay_rect(unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+												 uint32_t rgba);
+
+// Get the logical canvas size in pixel. This does not depend on the window size, the canvas is
+// scaled to fit the window instead.
 void canvas_get_size(unsigned int* width, unsigned int* height);
 
 #endif /* CANVAS_H_ */
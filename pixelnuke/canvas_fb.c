@@ -0,0 +1,594 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "canvas.h"
+#include "heatmap.h"
+#include "layer.h"
+#include "render.h"
+
+#ifdef PIXELNUKE_DRM
+#include <poll.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#endif
+
+// Framebuffer backend: Draws directly into a Linux framebuffer device (/dev/fbX) or a DRM dumb
+// buffer (/dev/dri/cardX), no X server or OpenGL required. The device is selected with the
+// PIXELNUKE_FB environment variable and defaults to /dev/fb0.
+//
+// If PIXELNUKE_FB points to a regular file instead, that file is used as a fake framebuffer with
+// the geometry from PIXELNUKE_FB_GEOMETRY (<width>x<height>x<bits>, default 1024x768x32). The
+// file contains the raw frame and can be inspected or compared in tests.
+
+#define FB_DEFAULT_DEVICE "/dev/fb0"
+#define FB_DEFAULT_GEOMETRY "1024x768x32"
+#define FB_MAX_PAGES 2
+// Frame rate used in vsync mode if the device cannot wait for the vertical blank itself
+#define FB_FALLBACK_FPS 60
+
+typedef struct FbOutput {
+	int fd;
+	unsigned int width;
+	unsigned int height;
+	// Bytes per pixel (2, 3 or 4) and bytes per line
+	unsigned int bpp;
+	unsigned int stride;
+	// Position of the color channels within a pixel
+	struct fb_bitfield red;
+	struct fb_bitfield green;
+	struct fb_bitfield blue;
+	// With more than one page, frames are drawn to the back page and flipped afterwards.
+	unsigned int pages;
+	unsigned int page;
+	uint8_t* page_mem[FB_MAX_PAGES];
+	void (*flip)(struct FbOutput* out, unsigned int page);
+	void (*release)(struct FbOutput* out);
+	// fbdev specific
+	struct fb_var_screeninfo var;
+	void* map;
+	size_t map_size;
+#ifdef PIXELNUKE_DRM
+	// DRM specific
+	uint32_t connector_id;
+	uint32_t crtc_id;
+	drmModeModeInfo mode;
+	drmModeCrtc* saved_crtc;
+	uint32_t fb_id[FB_MAX_PAGES];
+	uint32_t handle[FB_MAX_PAGES];
+	size_t page_size;
+	int flip_pending;
+#endif
+} FbOutput;
+
+// Global state
+
+static FbOutput fb_out;
+static volatile int fb_should_close = 0;
+// Set by canvas_backend_redraw(), the render loop then marks all rows as pending
+static volatile int fb_do_redraw = 0;
+static int fb_display = -1;
+// Integer scale factor and position of the canvas on the screen
+static unsigned int fb_scale = 1;
+static unsigned int fb_offset_x = 0;
+static unsigned int fb_offset_y = 0;
+// Part of the canvas that is visible on screen
+static unsigned int fb_visible_w = 0;
+static unsigned int fb_visible_h = 0;
+// One bit per page and canvas row, set if that row still needs to be copied to that page.
+static uint8_t* fb_pending;
+// A single scaled output line in framebuffer format
+static uint8_t* fb_line;
+// Wakes up the render loop while it sleeps in idle mode
+static pthread_mutex_t fb_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fb_wake = PTHREAD_COND_INITIALIZER;
+
+// User callbacks
+
+void (*canvas_on_close_cb)();
+void (*canvas_on_resize_cb)();
+void (*canvas_on_key_cb)(int, int, int);
+
+// Pixel conversion
+
+static inline uint32_t fb_channel(const struct fb_bitfield* f, uint8_t value) {
+	return (uint32_t)(value >> (8 - f->length)) << f->offset;
+}
+
+static inline uint32_t fb_pack(const FbOutput* out, uint8_t r, uint8_t g, uint8_t b) {
+	return fb_channel(&out->red, r) | fb_channel(&out->green, g) | fb_channel(&out->blue, b);
+}
+
+static void fb_set_rgb(FbOutput* out, unsigned int roff, unsigned int goff, unsigned int boff,
+											 unsigned int rlen, unsigned int glen, unsigned int blen) {
+	out->red = (struct fb_bitfield){.offset = roff, .length = rlen};
+	out->green = (struct fb_bitfield){.offset = goff, .length = glen};
+	out->blue = (struct fb_bitfield){.offset = boff, .length = blen};
+}
+
+// Compose canvas row y (base + overlay), scale it by fb_scale in both directions and copy it to
+// the given page.
+static void fb_draw_row(FbOutput* out, uint8_t* page, unsigned int y) {
+	const uint8_t* src = canvas_base->data + y * canvas_base->stride;
+	const uint8_t* ovl = canvas_overlay->data + y * canvas_overlay->stride;
+	uint8_t* dst = fb_line;
+	// Debug overlay: Tint each tile red according to its write rate
+	const uint8_t* heat =
+			heatmap_overlay ? heatmap_alpha + (y / CANVAS_TILE_SIZE) * heatmap_tiles_x : NULL;
+
+	for (unsigned int x = 0; x < fb_visible_w; x++, src += 3, ovl += 4) {
+		unsigned int r = src[0], g = src[1], b = src[2], a = ovl[3];
+		if (a) {
+			unsigned int na = 0xff - a;
+			r = (a * ovl[0] + na * r) / 0xff;
+			g = (a * ovl[1] + na * g) / 0xff;
+			b = (a * ovl[2] + na * b) / 0xff;
+		}
+		if (heat && (a = heat[x / CANVAS_TILE_SIZE])) {
+			unsigned int na = 0xff - a;
+			r = (a * 0xff + na * r) / 0xff;
+			g = na * g / 0xff;
+			b = na * b / 0xff;
+		}
+
+		uint32_t px = fb_pack(out, r, g, b);
+		for (unsigned int i = 0; i < fb_scale; i++, dst += out->bpp) {
+			if (out->bpp == 4) {
+				*(uint32_t*)dst = px;
+			} else if (out->bpp == 2) {
+				*(uint16_t*)dst = px;
+			} else {
+				dst[0] = px;
+				dst[1] = px >> 8;
+				dst[2] = px >> 16;
+			}
+		}
+	}
+
+	size_t len = dst - fb_line;
+	uint8_t* line = page + (size_t)(fb_offset_y + y * fb_scale) * out->stride + fb_offset_x * out->bpp;
+	for (unsigned int i = 0; i < fb_scale; i++, line += out->stride) memcpy(line, fb_line, len);
+}
+
+// fbdev output
+
+static void fb_fbdev_flip(FbOutput* out, unsigned int page) {
+	int arg = 0;
+	ioctl(out->fd, FBIO_WAITFORVSYNC, &arg);	// Not supported by all drivers, so ignore errors
+	out->var.yoffset = page * out->height;
+	if (ioctl(out->fd, FBIOPAN_DISPLAY, &out->var)) {
+		printf("Framebuffer page flip failed: %s\n", strerror(errno));
+	}
+}
+
+static void fb_fbdev_release(FbOutput* out) {
+	if (out->pages > 1 && out->page != 0) fb_fbdev_flip(out, 0);
+	munmap(out->map, out->map_size);
+	close(out->fd);
+}
+
+static int fb_open_fake(FbOutput* out, const char* path) {
+	const char* geometry = getenv("PIXELNUKE_FB_GEOMETRY");
+	unsigned int bits;
+	if (!geometry) geometry = FB_DEFAULT_GEOMETRY;
+	if (sscanf(geometry, "%ux%ux%u", &out->width, &out->height, &bits) != 3 || !out->width ||
+			!out->height) {
+		printf("Invalid fake framebuffer geometry: %s\n", geometry);
+		return -1;
+	}
+
+	if (bits == 32 || bits == 24) {
+		fb_set_rgb(out, 16, 8, 0, 8, 8, 8);
+	} else if (bits == 16) {
+		fb_set_rgb(out, 11, 5, 0, 5, 6, 5);
+	} else {
+		printf("Unsupported fake framebuffer depth: %u\n", bits);
+		return -1;
+	}
+
+	out->bpp = bits / 8;
+	out->stride = out->width * out->bpp;
+	out->pages = 1;
+	out->map_size = (size_t)out->stride * out->height;
+	if (ftruncate(out->fd, out->map_size)) {
+		printf("Could not resize fake framebuffer %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	printf("Using fake framebuffer %s (%ux%ux%u)\n", path, out->width, out->height, bits);
+	return 0;
+}
+
+static int fb_open_fbdev(FbOutput* out, const char* path) {
+	struct fb_fix_screeninfo fix;
+	struct stat st;
+
+	out->fd = open(path, O_RDWR | O_CLOEXEC);
+	if (out->fd < 0) {
+		printf("Could not open framebuffer %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(out->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		if (fb_open_fake(out, path)) goto fail;
+	} else {
+		if (ioctl(out->fd, FBIOGET_VSCREENINFO, &out->var) ||
+				ioctl(out->fd, FBIOGET_FSCREENINFO, &fix)) {
+			printf("Could not query framebuffer %s: %s\n", path, strerror(errno));
+			goto fail;
+		}
+
+		// Ask for a virtual screen twice as high to flip between two pages. Not all drivers support
+		// this, in which case we draw to the visible page directly.
+		if (out->var.yres_virtual < out->var.yres * 2) {
+			struct fb_var_screeninfo want = out->var;
+			want.yres_virtual = out->var.yres * 2;
+			want.yoffset = 0;
+			if (ioctl(out->fd, FBIOPUT_VSCREENINFO, &want) == 0) {
+				ioctl(out->fd, FBIOGET_VSCREENINFO, &out->var);
+				ioctl(out->fd, FBIOGET_FSCREENINFO, &fix);
+			}
+		}
+
+		if (out->var.bits_per_pixel != 16 && out->var.bits_per_pixel != 24 &&
+				out->var.bits_per_pixel != 32) {
+			printf("Unsupported framebuffer depth: %u\n", out->var.bits_per_pixel);
+			goto fail;
+		}
+
+		out->width = out->var.xres;
+		out->height = out->var.yres;
+		out->bpp = out->var.bits_per_pixel / 8;
+		out->stride = fix.line_length;
+		out->red = out->var.red;
+		out->green = out->var.green;
+		out->blue = out->var.blue;
+		out->pages = out->var.yres_virtual >= out->var.yres * 2 && fix.ypanstep ? 2 : 1;
+		out->map_size = fix.smem_len;
+	}
+
+	out->map = mmap(NULL, out->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, out->fd, 0);
+	if (out->map == MAP_FAILED) {
+		printf("Could not map framebuffer %s: %s\n", path, strerror(errno));
+		goto fail;
+	}
+
+	if (out->pages > 1) {
+		for (unsigned int i = 0; i < out->pages; i++)
+			out->page_mem[i] = (uint8_t*)out->map + (size_t)i * out->height * out->stride;
+		out->page = 0;
+		fb_fbdev_flip(out, 0);
+	} else {
+		out->page_mem[0] = (uint8_t*)out->map + (size_t)out->var.yoffset * out->stride +
+											 out->var.xoffset * out->bpp;
+	}
+
+	out->flip = fb_fbdev_flip;
+	out->release = fb_fbdev_release;
+	return 0;
+
+fail:
+	close(out->fd);
+	return -1;
+}
+
+// DRM output
+
+#ifdef PIXELNUKE_DRM
+static void fb_drm_on_flip(int fd, unsigned int frame, unsigned int sec, unsigned int usec,
+													 void* data) {
+	((FbOutput*)data)->flip_pending = 0;
+}
+
+static void fb_drm_flip(FbOutput* out, unsigned int page) {
+	if (drmModePageFlip(out->fd, out->crtc_id, out->fb_id[page], DRM_MODE_PAGE_FLIP_EVENT, out)) {
+		printf("DRM page flip failed: %s\n", strerror(errno));
+		return;
+	}
+
+	// Wait for the flip, so we never draw to a page that is still scanned out
+	drmEventContext ev = {.version = 2, .page_flip_handler = fb_drm_on_flip};
+	struct pollfd pfd = {.fd = out->fd, .events = POLLIN};
+	out->flip_pending = 1;
+	while (out->flip_pending && poll(&pfd, 1, 1000) > 0) drmHandleEvent(out->fd, &ev);
+}
+
+static void fb_drm_release(FbOutput* out) {
+	if (out->saved_crtc) {
+		drmModeCrtc* c = out->saved_crtc;
+		drmModeSetCrtc(out->fd, c->crtc_id, c->buffer_id, c->x, c->y, &out->connector_id, 1, &c->mode);
+		drmModeFreeCrtc(c);
+	}
+	for (unsigned int i = 0; i < out->pages; i++) {
+		struct drm_mode_destroy_dumb dreq = {.handle = out->handle[i]};
+		munmap(out->page_mem[i], out->page_size);
+		drmModeRmFB(out->fd, out->fb_id[i]);
+		drmIoctl(out->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
+	}
+	close(out->fd);
+}
+
+// Find a connected connector and a CRTC that can drive it.
+static int fb_drm_find_output(FbOutput* out, drmModeRes* res) {
+	for (int i = 0; i < res->count_connectors; i++) {
+		drmModeConnector* conn = drmModeGetConnector(out->fd, res->connectors[i]);
+		if (!conn) continue;
+		if (conn->connection != DRM_MODE_CONNECTED || conn->count_modes == 0) {
+			drmModeFreeConnector(conn);
+			continue;
+		}
+
+		out->connector_id = conn->connector_id;
+		out->mode = conn->modes[0];	 // The preferred mode comes first
+		out->crtc_id = 0;
+
+		for (int e = 0; e < conn->count_encoders && !out->crtc_id; e++) {
+			drmModeEncoder* enc = drmModeGetEncoder(out->fd, conn->encoders[e]);
+			if (!enc) continue;
+			if (enc->encoder_id == conn->encoder_id && enc->crtc_id) {
+				out->crtc_id = enc->crtc_id;
+			} else {
+				for (int c = 0; c < res->count_crtcs; c++) {
+					if (enc->possible_crtcs & (1 << c)) {
+						out->crtc_id = res->crtcs[c];
+						break;
+					}
+				}
+			}
+			drmModeFreeEncoder(enc);
+		}
+
+		drmModeFreeConnector(conn);
+		if (out->crtc_id) return 0;
+	}
+	return -1;
+}
+
+static int fb_open_drm(FbOutput* out, const char* path) {
+	out->fd = open(path, O_RDWR | O_CLOEXEC);
+	if (out->fd < 0) {
+		printf("Could not open DRM device %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	drmModeRes* res = drmModeGetResources(out->fd);
+	if (!res || fb_drm_find_output(out, res)) {
+		printf("No connected display found on %s\n", path);
+		if (res) drmModeFreeResources(res);
+		close(out->fd);
+		return -1;
+	}
+	drmModeFreeResources(res);
+
+	out->width = out->mode.hdisplay;
+	out->height = out->mode.vdisplay;
+	out->bpp = 4;
+	fb_set_rgb(out, 16, 8, 0, 8, 8, 8);	// XRGB8888
+	out->pages = 0;
+
+	for (unsigned int i = 0; i < FB_MAX_PAGES; i++) {
+		struct drm_mode_create_dumb creq = {.width = out->width, .height = out->height, .bpp = 32};
+		struct drm_mode_map_dumb mreq = {0};
+		if (drmIoctl(out->fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq)) goto fail;
+		out->handle[i] = creq.handle;
+		out->stride = creq.pitch;
+		out->page_size = creq.size;
+
+		mreq.handle = creq.handle;
+		if (drmModeAddFB(out->fd, out->width, out->height, 24, 32, creq.pitch, creq.handle,
+										 &out->fb_id[i]) ||
+				drmIoctl(out->fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq)) {
+			struct drm_mode_destroy_dumb dreq = {.handle = creq.handle};
+			drmIoctl(out->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
+			goto fail;
+		}
+
+		out->page_mem[i] =
+				mmap(NULL, creq.size, PROT_READ | PROT_WRITE, MAP_SHARED, out->fd, mreq.offset);
+		if (out->page_mem[i] == MAP_FAILED) {
+			struct drm_mode_destroy_dumb dreq = {.handle = creq.handle};
+			drmModeRmFB(out->fd, out->fb_id[i]);
+			drmIoctl(out->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
+			goto fail;
+		}
+		memset(out->page_mem[i], 0, creq.size);
+		out->pages++;
+	}
+
+	out->saved_crtc = drmModeGetCrtc(out->fd, out->crtc_id);
+	if (drmModeSetCrtc(out->fd, out->crtc_id, out->fb_id[0], 0, 0, &out->connector_id, 1,
+										 &out->mode)) {
+		printf("Could not set display mode on %s: %s\n", path, strerror(errno));
+		goto fail;
+	}
+
+	out->page = 0;
+	out->flip = fb_drm_flip;
+	out->release = fb_drm_release;
+	return 0;
+
+fail:
+	printf("Could not set up DRM buffers on %s\n", path);
+	fb_drm_release(out);
+	return -1;
+}
+#endif
+
+static int fb_open(FbOutput* out, const char* path) {
+	memset(out, 0, sizeof(FbOutput));
+	if (strncmp(path, "/dev/dri/", 9) == 0) {
+#ifdef PIXELNUKE_DRM
+		return fb_open_drm(out, path);
+#else
+		printf("DRM support not compiled in, use a /dev/fbX device instead of %s\n", path);
+		return -1;
+#endif
+	}
+	return fb_open_fbdev(out, path);
+}
+
+static void fb_layout(FbOutput* out) {
+	unsigned int w = canvas_base->width;
+	unsigned int h = canvas_base->height;
+
+	// Largest integer scale that still fits the whole canvas, but at least 1 (crop the rest)
+	fb_scale = out->width / w < out->height / h ? out->width / w : out->height / h;
+	if (fb_scale < 1) fb_scale = 1;
+
+	fb_visible_w = out->width / fb_scale < w ? out->width / fb_scale : w;
+	fb_visible_h = out->height / fb_scale < h ? out->height / fb_scale : h;
+	fb_offset_x = (out->width - fb_visible_w * fb_scale) / 2;
+	fb_offset_y = (out->height - fb_visible_h * fb_scale) / 2;
+
+	free(fb_line);
+	free(fb_pending);
+	fb_line = malloc((size_t)out->width * out->bpp);
+	fb_pending = malloc(h);
+	memset(fb_pending, (1 << out->pages) - 1, h);
+
+	for (unsigned int i = 0; i < out->pages; i++)
+		for (unsigned int y = 0; y < out->height; y++)
+			memset(out->page_mem[i] + (size_t)y * out->stride, 0, (size_t)out->width * out->bpp);
+
+	printf("Framebuffer %ux%u, showing %ux%u canvas pixels at scale %u\n", out->width, out->height,
+				 fb_visible_w, fb_visible_h, fb_scale);
+}
+
+// Render one frame to the back page and flip. Returns 0 if nothing changed.
+static int fb_render_frame(FbOutput* out) {
+	unsigned int back = (out->page + 1) % out->pages;
+	uint8_t mask = 1 << back;
+	uint8_t all = (1 << out->pages) - 1;
+	int drawn = 0;
+
+	canvas_base->dirty = 0;
+	canvas_overlay->dirty = 0;
+
+	if (fb_do_redraw) {
+		fb_do_redraw = 0;
+		memset(fb_pending, all, fb_visible_h);
+	}
+
+	// Only copy rows that changed since this page was drawn the last time
+	for (unsigned int y = 0; y < fb_visible_h; y++) {
+		if (canvas_base->dirty_rows[y] | canvas_overlay->dirty_rows[y]) {
+			canvas_base->dirty_rows[y] = 0;
+			canvas_overlay->dirty_rows[y] = 0;
+			fb_pending[y] = all;
+		}
+		if (fb_pending[y] & mask) {
+			fb_pending[y] &= ~mask;
+			fb_draw_row(out, out->page_mem[back], y);
+			drawn = 1;
+		}
+	}
+
+	if (drawn && out->pages > 1) {
+		out->flip(out, back);
+		out->page = back;
+	}
+	return drawn;
+}
+
+// Sleep until a layer becomes dirty, a redraw is requested, canvas_close() is called or the timeout
+// expires.
+static void fb_wait_dirty(double timeout) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	double deadline = ts.tv_sec + ts.tv_nsec / 1e9 + timeout;
+	ts.tv_sec = (time_t)deadline;
+	ts.tv_nsec = (long)((deadline - ts.tv_sec) * 1e9);
+
+	pthread_mutex_lock(&fb_wake_lock);
+	while (!fb_should_close && !fb_do_redraw && !canvas_base->dirty && !canvas_overlay->dirty) {
+		if (pthread_cond_timedwait(&fb_wake, &fb_wake_lock, &ts)) break;
+	}
+	pthread_mutex_unlock(&fb_wake_lock);
+}
+
+static void fb_render_loop(FbOutput* out) {
+	// Page flips wait for the vertical blank, so vsync mode only needs extra pacing without them.
+	double next_frame = render_now();
+	int drawn = 1;
+
+	while (!fb_should_close) {
+		// Rows still pending for the back page do not matter while it is not shown, so they can wait.
+		if (render_idle && !fb_do_redraw && !canvas_base->dirty && !canvas_overlay->dirty) {
+			double since = render_now();
+			fb_wait_dirty(1.0);
+			render_resume(&next_frame, since);
+		}
+
+		// Also paced if the last iteration had nothing to draw, instead of spinning
+		if (render_fps > 0) {
+			render_pace(&next_frame, 1.0 / render_fps);
+		} else if (!drawn || out->pages == 1) {
+			render_pace(&next_frame, 1.0 / FB_FALLBACK_FPS);
+		}
+
+		double start = render_now();
+		drawn = fb_render_frame(out);
+		if (drawn) render_frame_done(render_now() - start);
+	}
+}
+
+// Public functions
+
+void canvas_start(void (*on_close)()) {
+	canvas_on_close_cb = on_close;
+
+	const char* path = getenv("PIXELNUKE_FB");
+	if (!path) path = FB_DEFAULT_DEVICE;
+
+	if (fb_open(&fb_out, path) == 0) {
+		fb_layout(&fb_out);
+		if (canvas_on_resize_cb) (*canvas_on_resize_cb)();
+		fb_render_loop(&fb_out);
+		fb_out.release(&fb_out);
+	}
+
+	if (canvas_on_close_cb) (*canvas_on_close_cb)();
+
+	free(fb_line);
+	free(fb_pending);
+	// The pixel store is not freed, network threads may still be writing to it.
+}
+
+void canvas_setcb_key(void (*on_key)(int key, int scancode, int mods)) {
+	canvas_on_key_cb = on_key;
+}
+
+void canvas_setcb_resize(void (*on_resize)()) { canvas_on_resize_cb = on_resize; }
+
+void canvas_close() {
+	fb_should_close = 1;
+	canvas_backend_wake();
+}
+
+void canvas_backend_wake() {
+	if (!render_idle && !fb_should_close) return;
+	pthread_mutex_lock(&fb_wake_lock);
+	pthread_cond_signal(&fb_wake);
+	pthread_mutex_unlock(&fb_wake_lock);
+}
+
+void canvas_backend_redraw() {
+	fb_do_redraw = 1;
+	pthread_mutex_lock(&fb_wake_lock);
+	pthread_cond_signal(&fb_wake);
+	pthread_mutex_unlock(&fb_wake_lock);
+}
+
+// The framebuffer is always fullscreen on a single display, so this is remembered but has no effect.
+void canvas_fullscreen(int display) { fb_display = display; }
+
+int canvas_get_display() { return fb_display; }
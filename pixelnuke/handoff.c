@@ -0,0 +1,334 @@
+#define _GNU_SOURCE	// accept4
+#include "handoff.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "canvas.h"
+#include "layer.h"
+#include "net.h"
+#include "render.h"
+
+// Protocol, over a SOCK_SEQPACKET connection from the new to the old instance:
+//
+// 1. old -> new: HandoffHeader, with the memfds of the base and overlay layer attached if
+//    layer_fds is 2.
+// 2. old -> new: One message per network thread. The payload is a single byte with the number of
+//    attached fds: The TCP listener and, if the thread receives UDP datagrams, its UDP socket.
+// 3. new -> old: A single byte, confirming that the new instance took over.
+// 4. new -> old: A single byte once the new instance rendered its first frames, so the old one can
+//    close its window (or stop drawing to the framebuffer) without leaving the display dark.
+//
+// The connection stays open until the old instance exits, see handoff_watch().
+
+#define HANDOFF_MAGIC "PXNUKE1"
+#define HANDOFF_MAX_THREADS 256
+// Seconds the old instance keeps serving connected clients before it exits anyway
+#define HANDOFF_DRAIN_TIMEOUT 30
+// Seconds the old instance waits for the new one to confirm the handoff
+#define HANDOFF_ACK_TIMEOUT 5
+// Seconds the old instance keeps rendering while waiting for the first frames of the new one
+#define HANDOFF_SHOW_TIMEOUT 10
+// While the old instance still draws to the shared pixel data, the new one cannot tell which rows
+// changed and re-uploads everything at this interval, in milliseconds.
+#define HANDOFF_REFRESH 40
+
+typedef struct HandoffHeader {
+	char magic[8];
+	uint32_t width;
+	uint32_t height;
+	uint32_t layer_fds;
+	uint32_t threads;
+} HandoffHeader;
+
+// New instance: State received from the old one, -1 for fds not received
+static int handoff_conn = -1;
+static HandoffHeader handoff_header;
+static int handoff_layers[2] = {-1, -1};
+static int handoff_tcp[HANDOFF_MAX_THREADS];
+static int handoff_udp[HANDOFF_MAX_THREADS];
+
+// Old instance: Set once the state was handed over and the process is about to exit
+static volatile int handoff_replaced = 0;
+static pthread_t handoff_thread;
+
+typedef union HandoffControl {
+	char buf[CMSG_SPACE(2 * sizeof(int))];
+	struct cmsghdr align;
+} HandoffControl;
+
+static int handoff_address(const char* path, struct sockaddr_un* addr) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		printf("Handoff socket path too long: %s\n", path);
+		return 0;
+	}
+	strcpy(addr->sun_path, path);
+	return 1;
+}
+
+// Send one message with up to two fds attached. Returns 1 on success.
+static int handoff_send(int sock, const void* data, size_t len, const int* fds, int count) {
+	HandoffControl control;
+	struct iovec iov = {.iov_base = (void*)data, .iov_len = len};
+	struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+
+	if (count > 0) {
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+	}
+
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)len;
+}
+
+// Receive one message of exactly len bytes with up to two fds attached. Returns the number of fds
+// written to fds, or -1 on errors (received fds are closed then).
+static int handoff_recv(int sock, void* data, size_t len, int* fds) {
+	HandoffControl control;
+	struct iovec iov = {.iov_base = data, .iov_len = len};
+	struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	if (r < 0) return -1;
+
+	int count = 0;
+	for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+		int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds + count, CMSG_DATA(cmsg), n * sizeof(int));
+		count += n;
+	}
+
+	if (r != (ssize_t)len || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+		for (int i = 0; i < count; i++) close(fds[i]);
+		return -1;
+	}
+	return count;
+}
+
+// New instance
+
+static void* handoff_watch(void* arg) {
+	struct pollfd pfd = {.fd = handoff_conn, .events = POLLIN};
+	int shown = 0;
+	int r;
+	while ((r = poll(&pfd, 1, HANDOFF_REFRESH)) == 0 || (r < 0 && errno == EINTR)) {
+		canvas_layer_touch(canvas_base);
+		canvas_layer_touch(canvas_overlay);
+		// The first frame is counted before the GL backend swaps buffers, so wait for the second one
+		if (!shown && render_frame_count() > 1) {
+			uint8_t msg = 1;
+			send(handoff_conn, &msg, 1, MSG_NOSIGNAL);
+			shown = 1;
+		}
+	}
+	close(handoff_conn);
+	handoff_conn = -1;
+	puts("Previous instance exited");
+	return NULL;
+}
+
+int handoff_receive(const char* path) {
+	struct sockaddr_un addr;
+	if (!handoff_address(path, &addr)) return 0;
+
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0) return 0;
+	if (connect(sock, (const struct sockaddr*)&addr, sizeof(addr))) {
+		// Nobody to take over from, this is a normal start
+		close(sock);
+		return 0;
+	}
+
+	HandoffHeader* hdr = &handoff_header;
+	unsigned int threads = 0;
+	int fds[2];
+	int n = handoff_recv(sock, hdr, sizeof(*hdr), fds);
+	if (n < 0) goto fail;
+	if (memcmp(hdr->magic, HANDOFF_MAGIC, sizeof(hdr->magic)) || (n != 0 && n != 2) ||
+			(unsigned int)n != hdr->layer_fds || hdr->threads > HANDOFF_MAX_THREADS) {
+		for (int i = 0; i < n; i++) close(fds[i]);
+		goto fail;
+	}
+	if (n == 2) {
+		handoff_layers[0] = fds[0];
+		handoff_layers[1] = fds[1];
+	}
+
+	for (; threads < hdr->threads; threads++) {
+		uint8_t count;
+		n = handoff_recv(sock, &count, 1, fds);
+		if (n < 1 || n != count) {
+			for (int i = 0; i < n; i++) close(fds[i]);
+			goto fail;
+		}
+		handoff_tcp[threads] = fds[0];
+		handoff_udp[threads] = n > 1 ? fds[1] : -1;
+	}
+
+	uint8_t ack = 1;
+	if (send(sock, &ack, 1, MSG_NOSIGNAL) != 1) goto fail;
+
+	printf("Took over %u listeners from the previous instance\n", threads);
+	handoff_conn = sock;
+	return 1;
+
+fail:
+	printf("Handoff from %s failed, starting normally\n", path);
+	for (int i = 0; i < 2; i++) {
+		if (handoff_layers[i] >= 0) close(handoff_layers[i]);
+		handoff_layers[i] = -1;
+	}
+	for (unsigned int i = 0; i < threads; i++) {
+		close(handoff_tcp[i]);
+		if (handoff_udp[i] >= 0) close(handoff_udp[i]);
+	}
+	close(sock);
+	return 0;
+}
+
+void handoff_adopt() {
+	if (handoff_conn < 0) return;
+
+	unsigned int width, height;
+	canvas_get_size(&width, &height);
+	if (handoff_layers[0] >= 0) {
+		if (width != handoff_header.width || height != handoff_header.height) {
+			printf("Canvas size changed from %ux%u, starting with an empty canvas\n",
+						 handoff_header.width, handoff_header.height);
+		} else {
+			if (canvas_layer_adopt(canvas_base, handoff_layers[0])) handoff_layers[0] = -1;
+			if (canvas_layer_adopt(canvas_overlay, handoff_layers[1])) handoff_layers[1] = -1;
+		}
+		// Not adopted for whatever reason
+		if (handoff_layers[0] >= 0) close(handoff_layers[0]);
+		if (handoff_layers[1] >= 0) close(handoff_layers[1]);
+	}
+
+	net_adopt_listeners(handoff_tcp, handoff_udp, handoff_header.threads);
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, handoff_watch, NULL)) {
+		close(handoff_conn);
+		handoff_conn = -1;
+	}
+}
+
+// Old instance
+
+// Send our state to a new instance. Returns 1 once the new instance confirmed.
+static int handoff_send_state(int sock) {
+	int tcp[HANDOFF_MAX_THREADS], udp[HANDOFF_MAX_THREADS];
+	int threads = net_get_listeners(tcp, udp, HANDOFF_MAX_THREADS);
+
+	HandoffHeader hdr = {.magic = HANDOFF_MAGIC, .threads = threads};
+	canvas_get_size(&hdr.width, &hdr.height);
+	int layers[2] = {canvas_base->fd, canvas_overlay->fd};
+	hdr.layer_fds = layers[0] >= 0 && layers[1] >= 0 ? 2 : 0;
+	if (!handoff_send(sock, &hdr, sizeof(hdr), layers, hdr.layer_fds)) return 0;
+
+	for (int i = 0; i < threads; i++) {
+		int fds[2] = {tcp[i], udp[i]};
+		uint8_t count = udp[i] >= 0 ? 2 : 1;
+		if (!handoff_send(sock, &count, 1, fds, count)) return 0;
+	}
+
+	struct timeval timeout = {.tv_sec = HANDOFF_ACK_TIMEOUT};
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	uint8_t ack;
+	return recv(sock, &ack, 1, 0) == 1;
+}
+
+// Keep rendering until the new instance has its first frames on screen, it exited or the timeout
+// expired. Clients of the new instance draw to the shared pixel data, so redraw all of it.
+static void handoff_wait_shown(int sock) {
+	struct pollfd pfd = {.fd = sock, .events = POLLIN};
+	time_t deadline = time(NULL) + HANDOFF_SHOW_TIMEOUT;
+	int r;
+	while (time(NULL) < deadline &&
+				 ((r = poll(&pfd, 1, HANDOFF_REFRESH)) == 0 || (r < 0 && errno == EINTR))) {
+		canvas_layer_touch(canvas_base);
+		canvas_layer_touch(canvas_overlay);
+	}
+}
+
+static void handoff_drain(int sock) {
+	handoff_replaced = 1;
+	net_stop_listening();
+	handoff_wait_shown(sock);
+	canvas_close();
+
+	time_t deadline = time(NULL) + HANDOFF_DRAIN_TIMEOUT;
+	unsigned int clients;
+	while ((clients = net_client_count()) > 0 && time(NULL) < deadline) usleep(100 * 1000);
+	if (clients) printf("Closing %u remaining connections\n", clients);
+
+	// Also closes the handoff connection, which tells the new instance that we are gone
+	exit(0);
+}
+
+static void* handoff_serve(void* arg) {
+	int server = (int)(intptr_t)arg;
+
+	for (;;) {
+		int sock = accept4(server, NULL, NULL, SOCK_CLOEXEC);
+		if (sock < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			printf("Handoff socket failed: %s\n", strerror(errno));
+			close(server);
+			return NULL;
+		}
+
+		if (handoff_send_state(sock)) {
+			puts("Handed over to a new instance, draining");
+			close(server);
+			handoff_drain(sock);
+		}
+
+		puts("Handoff to a new instance failed, continuing");
+		close(sock);
+	}
+}
+
+void handoff_listen(const char* path) {
+	struct sockaddr_un addr;
+	if (!handoff_address(path, &addr)) return;
+
+	int server = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (server < 0) return;
+	// The previous instance (if any) is done with it, or crashed without cleaning up
+	unlink(path);
+	if (bind(server, (const struct sockaddr*)&addr, sizeof(addr)) || listen(server, 1)) {
+		printf("Could not listen on handoff socket %s: %s\n", path, strerror(errno));
+		close(server);
+		return;
+	}
+
+	if (pthread_create(&handoff_thread, NULL, handoff_serve, (void*)(intptr_t)server)) {
+		printf("Failed to start handoff thread\n");
+		close(server);
+	}
+}
+
+void handoff_finish() {
+	// The handoff thread ends the process once all clients are gone
+	if (handoff_replaced) pthread_join(handoff_thread, NULL);
+}
@@ -0,0 +1,31 @@
+#ifndef HANDOFF_H_
+#define HANDOFF_H_
+
+// Zero-downtime restarts: A running instance listens on a Unix socket. A new instance started
+// with the same socket path connects to it and receives the listening sockets of all network
+// threads and the pixel data of both layers (memfds, see CanvasLayer.fd). The new instance
+// accepts connections immediately, while the old one stops accepting. The old instance keeps
+// rendering until the new one has a frame on screen (or HANDOFF_SHOW_TIMEOUT seconds passed), so
+// the display never goes dark, and exits once its remaining clients disconnected (or after
+// HANDOFF_DRAIN_TIMEOUT seconds). Both draw to the same shared pixel data in the meantime.
+//
+// Usage: handoff_receive() before canvas_init(), handoff_adopt() after canvas_init() and before
+// start_event_loops(), handoff_listen() once the network threads are running, and
+// handoff_finish() after canvas_start() returned.
+
+// Try to take over from an instance listening on path. Returns 1 on success.
+int handoff_receive(const char *path);
+
+// Apply what handoff_receive() got: Adopt the pixel data (if the canvas size did not change) and
+// the listening sockets.
+void handoff_adopt();
+
+// Listen on path (replacing any stale socket) and hand everything over to the next instance that
+// connects. Runs in a separate thread and returns immediately.
+void handoff_listen(const char *path);
+
+// Wait until the remaining clients disconnected if this instance was replaced, return immediately
+// otherwise.
+void handoff_finish();
+
+#endif /* HANDOFF_H_ */
@@ -0,0 +1,120 @@
+#include "heatmap.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "render.h"
+
+// Threads beyond this share a single shard. Increments on it are not atomic and may get lost,
+// which is fine for a heatmap.
+#define HEATMAP_MAX_SHARDS 1024
+// Time constant of the exponential decay, in seconds. Rates follow changes in load within a few
+// multiples of this.
+#define HEATMAP_DECAY 5.0
+// How often the debug overlay is updated, in milliseconds
+#define HEATMAP_REFRESH 250
+
+unsigned int heatmap_tiles_x = 0;
+unsigned int heatmap_tiles_y = 0;
+_Thread_local uint32_t* heatmap_shard = NULL;
+
+int heatmap_overlay = 0;
+uint8_t* heatmap_alpha = NULL;
+
+static size_t heatmap_tiles = 0;
+
+// Shards only ever grow, threads keep their shard until the process exits
+static pthread_mutex_t heatmap_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t* heatmap_shards[HEATMAP_MAX_SHARDS];
+static unsigned int heatmap_shard_count = 0;
+
+// Sampler state, protected by heatmap_lock: Sum of all shards at the last sample, and decayed rates
+static uint32_t* heatmap_last = NULL;
+static float* heatmap_rates = NULL;
+static double heatmap_last_time = 0;
+
+static void* heatmap_overlay_thread(void* arg) {
+	for (;;) {
+		usleep(HEATMAP_REFRESH * 1000);
+		heatmap_sample(NULL, NULL);
+		// The overlay changes even if the canvas does not
+		canvas_backend_redraw();
+	}
+	return NULL;
+}
+
+static void heatmap_start_overlay() {
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, heatmap_overlay_thread, NULL)) {
+		printf("Failed to start heatmap thread\n");
+		heatmap_overlay = 0;
+	}
+}
+
+void heatmap_init(unsigned int width, unsigned int height) {
+	heatmap_tiles_x = (width + CANVAS_TILE_SIZE - 1) / CANVAS_TILE_SIZE;
+	heatmap_tiles_y = (height + CANVAS_TILE_SIZE - 1) / CANVAS_TILE_SIZE;
+	heatmap_tiles = (size_t)heatmap_tiles_x * heatmap_tiles_y;
+	heatmap_last = calloc(heatmap_tiles, sizeof(uint32_t));
+	heatmap_rates = calloc(heatmap_tiles, sizeof(float));
+	heatmap_alpha = calloc(heatmap_tiles, 1);
+	heatmap_last_time = render_now();
+	if (heatmap_overlay) heatmap_start_overlay();
+}
+
+uint32_t* heatmap_register_shard() {
+	pthread_mutex_lock(&heatmap_lock);
+	if (heatmap_shard_count < HEATMAP_MAX_SHARDS) {
+		heatmap_shards[heatmap_shard_count++] = calloc(heatmap_tiles, sizeof(uint32_t));
+	}
+	heatmap_shard = heatmap_shards[heatmap_shard_count - 1];
+	pthread_mutex_unlock(&heatmap_lock);
+	return heatmap_shard;
+}
+
+void heatmap_sample(float* rates, HeatmapStats* stats) {
+	pthread_mutex_lock(&heatmap_lock);
+
+	double now = render_now();
+	double dt = now - heatmap_last_time;
+	heatmap_last_time = now;
+	// Weighted so that a constant write rate converges to exactly that rate, no matter how often
+	// we sample
+	double keep = exp(-dt / HEATMAP_DECAY);
+	double scale = dt > 0 ? (1 - keep) / dt : 0;
+
+	HeatmapStats s = {0};
+	for (size_t t = 0; t < heatmap_tiles; t++) {
+		uint32_t sum = 0;
+		for (unsigned int i = 0; i < heatmap_shard_count; i++) sum += heatmap_shards[i][t];
+		// Counters wrap around, the difference is still correct
+		uint32_t delta = sum - heatmap_last[t];
+		heatmap_last[t] = sum;
+
+		float rate = heatmap_rates[t] * keep + delta * scale;
+		heatmap_rates[t] = rate;
+		s.total += rate;
+		if (rate > s.max) {
+			s.max = rate;
+			s.max_x = t % heatmap_tiles_x;
+			s.max_y = t / heatmap_tiles_x;
+		}
+	}
+
+	if (heatmap_overlay) {
+		// Log scale, otherwise a single hotspot hides everything else
+		double norm = s.max >= 1 ? 224 / log1p(s.max) : 0;
+		for (size_t t = 0; t < heatmap_tiles; t++) heatmap_alpha[t] = log1p(heatmap_rates[t]) * norm;
+	}
+
+	if (rates) memcpy(rates, heatmap_rates, heatmap_tiles * sizeof(float));
+	pthread_mutex_unlock(&heatmap_lock);
+
+	if (stats) *stats = s;
+}
+
+void heatmap_set_overlay(int enabled) { heatmap_overlay = enabled; }
@@ -0,0 +1,56 @@
+#ifndef HEATMAP_H_
+#define HEATMAP_H_
+
+#include <stdint.h>
+
+#include "layer.h"
+
+// Write density per CANVAS_TILE_SIZE tile of the base layer. Each writing thread counts into its
+// own shard of counters, so there is no contention between network threads. heatmap_sample()
+// sums up the shards into exponentially decayed rates in pixels per second.
+
+typedef struct HeatmapStats {
+	// Decayed write rate of the whole canvas and of the hottest tile, in pixels per second
+	double total;
+	double max;
+	unsigned int max_x;
+	unsigned int max_y;
+} HeatmapStats;
+
+extern unsigned int heatmap_tiles_x;
+extern unsigned int heatmap_tiles_y;
+extern _Thread_local uint32_t* heatmap_shard;
+
+// Set while the debug overlay is enabled. heatmap_alpha then contains one opacity per tile,
+// relative to the hottest tile, for backends to draw on top of the canvas.
+extern int heatmap_overlay;
+extern uint8_t* heatmap_alpha;
+
+// Allocate counters for a canvas of the given size. Called by canvas_init().
+void heatmap_init(unsigned int width, unsigned int height);
+
+// Slow path of heatmap_count(): Give the calling thread its own shard
+uint32_t* heatmap_register_shard();
+
+// Count a write to the base layer. x and y must be within the canvas.
+static inline void heatmap_count(unsigned int x, unsigned int y) {
+	uint32_t* shard = heatmap_shard;
+	if (!shard) shard = heatmap_register_shard();
+	shard[(y / CANVAS_TILE_SIZE) * heatmap_tiles_x + x / CANVAS_TILE_SIZE]++;
+}
+
+// Count n writes to tile (tx, ty) of the base layer, which must be within the canvas
+static inline void heatmap_count_tile(unsigned int tx, unsigned int ty, unsigned int n) {
+	uint32_t* shard = heatmap_shard;
+	if (!shard) shard = heatmap_register_shard();
+	shard[ty * heatmap_tiles_x + tx] += n;
+}
+
+// Fold new writes into the decayed rates (and heatmap_alpha). If rates is not NULL, copy the
+// rate of each tile (heatmap_tiles_x * heatmap_tiles_y, row by row) into it. Thread-safe.
+void heatmap_sample(float* rates, HeatmapStats* stats);
+
+// Enable the debug overlay. Must be called before heatmap_init().
+void heatmap_set_overlay(int enabled);
+
+#endif /* HEATMAP_H_ */
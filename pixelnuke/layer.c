@@ -0,0 +1,344 @@
+#define _GNU_SOURCE	// memfd_create
+#include "layer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "canvas.h"
+#include "heatmap.h"
+#include "render.h"
+
+CanvasLayer* canvas_base;
+CanvasLayer* canvas_overlay;
+
+CanvasLayer* canvas_layer_alloc(unsigned int width, unsigned int height, int alpha) {
+	CanvasLayer* layer = malloc(sizeof(CanvasLayer));
+	layer->width = width;
+	layer->height = height;
+	layer->alpha = alpha;
+	layer->bpp = alpha ? 4 : 3;
+	layer->tex = layer->pbo1 = layer->pbo2 = 0;
+
+	// Pad rows to a whole number of pixels that is also a multiple of CANVAS_ROW_ALIGN bytes. Some
+	// backends (OpenGL) need the stride in pixels.
+	unsigned int pad = alpha ? CANVAS_ROW_ALIGN / 4 : CANVAS_ROW_ALIGN;
+	layer->stride = (size_t)(width + pad - 1) / pad * pad * layer->bpp;
+	layer->mem = layer->stride * height;
+	layer->fd = -1;
+	layer->data = NULL;
+#ifdef __linux__
+	// Keep pixel data in a memfd that can be handed over to a new process on restart. Mappings are
+	// page aligned and zero filled.
+	layer->fd = memfd_create(alpha ? "pixelnuke-overlay" : "pixelnuke-base", MFD_CLOEXEC);
+	if (layer->fd >= 0) {
+		void* data = MAP_FAILED;
+		if (ftruncate(layer->fd, layer->mem) == 0)
+			data = mmap(NULL, layer->mem, PROT_READ | PROT_WRITE, MAP_SHARED, layer->fd, 0);
+		if (data != MAP_FAILED) {
+			layer->data = data;
+		} else {
+			close(layer->fd);
+			layer->fd = -1;
+		}
+	}
+#endif
+	if (!layer->data) {
+		layer->data = aligned_alloc(CANVAS_ROW_ALIGN, layer->mem);
+		memset(layer->data, 0, layer->mem);
+	}
+	layer->dirty_rows = malloc(height);
+	layer->changed = NULL;
+	layer->changed_tiles = NULL;
+	layer->tiles_x = (width + CANVAS_TILE_SIZE - 1) / CANVAS_TILE_SIZE;
+	layer->tiles_y = (height + CANVAS_TILE_SIZE - 1) / CANVAS_TILE_SIZE;
+	// Upload at least once, otherwise the backend has nothing to show
+	canvas_layer_touch(layer);
+	return layer;
+}
+
+void canvas_layer_free(CanvasLayer* layer) {
+	if (layer->fd >= 0) {
+		munmap(layer->data, layer->mem);
+		close(layer->fd);
+	} else {
+		free(layer->data);
+	}
+	free(layer->dirty_rows);
+	free(layer->changed);
+	free(layer->changed_tiles);
+	free(layer);
+}
+
+void canvas_layer_touch(CanvasLayer* layer) {
+	memset(layer->dirty_rows, 1, layer->height);
+	layer->dirty = 1;
+	canvas_backend_wake();
+}
+
+int canvas_layer_adopt(CanvasLayer* layer, int fd) {
+	struct stat st;
+	if (fstat(fd, &st) || (size_t)st.st_size != layer->mem) return 0;
+	void* data = mmap(NULL, layer->mem, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) return 0;
+
+	if (layer->fd >= 0) {
+		munmap(layer->data, layer->mem);
+		close(layer->fd);
+	} else {
+		free(layer->data);
+	}
+	layer->data = data;
+	layer->fd = fd;
+	canvas_layer_touch(layer);
+	return 1;
+}
+
+void canvas_layer_track_changes(CanvasLayer* layer) {
+	layer->changed = calloc((size_t)layer->width * layer->height, 1);
+	layer->changed_tiles = calloc((size_t)layer->tiles_x * layer->tiles_y, 1);
+}
+
+// Mark row y as changed. Only the first change after a frame needs to wake up an idle render loop.
+static inline void canvas_layer_mark_row(CanvasLayer* layer, unsigned int y) {
+	layer->dirty_rows[y] = 1;
+	if (!layer->dirty) {
+		layer->dirty = 1;
+		canvas_backend_wake();
+	}
+}
+
+static inline void canvas_layer_mark(CanvasLayer* layer, unsigned int x, unsigned int y) {
+	if (layer->changed) {
+		// Pixel first, so a consumer that clears the tile flag before scanning never misses a change
+		layer->changed[(size_t)y * layer->width + x] = 1;
+		layer->changed_tiles[(y / CANVAS_TILE_SIZE) * layer->tiles_x + x / CANVAS_TILE_SIZE] = 1;
+	}
+	canvas_layer_mark_row(layer, y);
+}
+
+// Same as canvas_layer_mark(), for w pixels starting at x
+static inline void canvas_layer_mark_span(CanvasLayer* layer, unsigned int x, unsigned int y,
+																					unsigned int w) {
+	if (layer->changed) {
+		memset(layer->changed + (size_t)y * layer->width + x, 1, w);
+		uint8_t* tiles = layer->changed_tiles + (y / CANVAS_TILE_SIZE) * layer->tiles_x;
+		for (unsigned int tx = x / CANVAS_TILE_SIZE; tx <= (x + w - 1) / CANVAS_TILE_SIZE; tx++)
+			tiles[tx] = 1;
+	}
+	canvas_layer_mark_row(layer, y);
+}
+
+static inline uint8_t* canvas_offset(CanvasLayer* layer, unsigned int x, unsigned int y) {
+	if (x >= layer->width || y >= layer->height) return NULL;
+	return layer->data + y * layer->stride + x * layer->bpp;
+}
+
+// Pixel kernels: Write a single pixel without any checks, one kernel per layer format and blend
+// mode. Callers pick the kernel once per command, so loops over many pixels do not branch on the
+// format or the alpha value.
+
+// RGBA layers (overlay): Store as-is
+static inline void canvas_kernel_rgba(uint8_t* ptr, uint32_t rgba) {
+	ptr[0] = rgba >> 24;
+	ptr[1] = rgba >> 16;
+	ptr[2] = rgba >> 8;
+	ptr[3] = rgba;
+}
+
+// RGB layers (base), opaque colors: Replace
+static inline void canvas_kernel_rgb(uint8_t* ptr, uint32_t rgba) {
+	ptr[0] = rgba >> 24;
+	ptr[1] = rgba >> 16;
+	ptr[2] = rgba >> 8;
+}
+
+// RGB layers (base), translucent colors: Blend over the current color
+static inline void canvas_kernel_rgb_blend(uint8_t* ptr, uint32_t rgba) {
+	unsigned int a = rgba & 0xff, na = 0xff - a;
+	ptr[0] = (a * (rgba >> 24) + na * ptr[0]) / 0xff;
+	ptr[1] = (a * (rgba >> 16 & 0xff) + na * ptr[1]) / 0xff;
+	ptr[2] = (a * (rgba >> 8 & 0xff) + na * ptr[2]) / 0xff;
+}
+
+// Generate <kernel>_span(layer, x, y, w, rgba), which applies a kernel to w pixels of row y
+// starting at x. All of them must be within the layer.
+#define CANVAS_SPAN(kernel, bpp)                                                                  \
+	static void kernel##_span(CanvasLayer* layer, unsigned int x, unsigned int y, unsigned int w, \
+														uint32_t rgba) {                                                    \
+		uint8_t* ptr = layer->data + y * layer->stride + x * (bpp);                                 \
+		for (uint8_t* end = ptr + w * (bpp); ptr < end; ptr += (bpp)) kernel(ptr, rgba);          \
+		canvas_layer_mark_span(layer, x, y, w);                                                     \
+	}
+
+CANVAS_SPAN(canvas_kernel_rgba, 4)
+CANVAS_SPAN(canvas_kernel_rgb, 3)
+CANVAS_SPAN(canvas_kernel_rgb_blend, 3)
+
+typedef void (*CanvasSpan)(CanvasLayer* layer, unsigned int x, unsigned int y, unsigned int w,
+													 uint32_t rgba);
+
+// Pick the span function for drawing rgba to a layer. Returns NULL if there is nothing to draw.
+static CanvasSpan canvas_layer_span(CanvasLayer* layer, uint32_t rgba) {
+	if (layer->alpha) return canvas_kernel_rgba_span;
+	switch (rgba & 0xff) {
+		case 0:
+			return NULL;
+		case 0xff:
+			return canvas_kernel_rgb_span;
+		default:
+			return canvas_kernel_rgb_blend_span;
+	}
+}
+
+static void canvas_layer_set_px(CanvasLayer* layer, unsigned int x, unsigned int y, uint32_t rgba) {
+	uint8_t* ptr = canvas_offset(layer, x, y);
+	if (ptr == NULL) return;
+
+	uint8_t a = rgba & 0xff;
+	if (layer->alpha) {
+		canvas_kernel_rgba(ptr, rgba);
+	} else if (a == 0xff) {
+		canvas_kernel_rgb(ptr, rgba);
+	} else if (a) {
+		canvas_kernel_rgb_blend(ptr, rgba);
+	} else {
+		return;
+	}
+	canvas_layer_mark(layer, x, y);
+}
+
+// Clipped to the layer once, then drawn row by row with a single kernel
+static void canvas_layer_rect(CanvasLayer* layer, unsigned int x, unsigned int y, unsigned int w,
+															unsigned int h, uint32_t rgba) {
+	if (x >= layer->width || y >= layer->height || w == 0) return;
+	unsigned int x2 = w > layer->width - x ? layer->width : x + w;
+	unsigned int y2 = h > layer->height - y ? layer->height : y + h;
+	CanvasSpan span = canvas_layer_span(layer, rgba);
+	if (!span) return;
+	for (unsigned int iy = y; iy < y2; iy++) span(layer, x, iy, x2 - x, rgba);
+}
+
+// Write the pixel records of a tile to data, the top left pixel of the tile. Returns a mask of the
+// rows written and the number of records, not counting skipped ones. Tiles within the canvas are
+// not clipped: Records are masked to the tile and always written, without any branches. Edge tiles
+// are clipped to w x h pixels.
+static inline uint64_t canvas_tile_write(uint8_t* data, size_t stride, const uint8_t* records,
+																				 unsigned int n, int clip, unsigned int w, unsigned int h,
+																				 unsigned int* count) {
+	uint64_t rows = 0;
+	unsigned int written = 0;
+	for (const uint8_t* rec = records; rec < records + n * CANVAS_TILE_RECORD;
+			 rec += CANVAS_TILE_RECORD) {
+		unsigned int pos = (rec[0] | rec[1] << 8) & (CANVAS_TILE_SIZE * CANVAS_TILE_SIZE - 1);
+		unsigned int x = pos % CANVAS_TILE_SIZE, y = pos / CANVAS_TILE_SIZE;
+		if (clip && (x >= w || y >= h)) continue;
+		uint32_t rgba = (uint32_t)rec[2] << 24 | rec[3] << 16 | rec[4] << 8 | 0xff;
+		canvas_kernel_rgb(data + y * stride + x * 3, rgba);
+		rows |= (uint64_t)1 << y;
+		written++;
+	}
+	*count = written;
+	return rows;
+}
+
+// Public functions
+
+void canvas_init(unsigned int width, unsigned int height) {
+	canvas_base = canvas_layer_alloc(width, height, 0);
+	canvas_overlay = canvas_layer_alloc(width, height, 1);
+	heatmap_init(width, height);
+}
+
+void canvas_set_px(unsigned int x, unsigned int y, uint32_t rgba) {
+	if (x < canvas_base->width && y < canvas_base->height) heatmap_count(x, y);
+	canvas_layer_set_px(canvas_base, x, y, rgba);
+}
+
+void canvas_set_px_batch(const CanvasPixel* px, size_t count) {
+	// Loaded once instead of per pixel, the base layer is always RGB
+	CanvasLayer* layer = canvas_base;
+	const unsigned int width = layer->width, height = layer->height;
+	const size_t stride = layer->stride;
+	uint8_t* data = layer->data;
+
+	for (const CanvasPixel* end = px + count; px < end; px++) {
+		unsigned int x = px->x, y = px->y;
+		if (x >= width || y >= height) continue;
+		heatmap_count(x, y);
+
+		uint8_t* ptr = data + y * stride + x * 3;
+		uint8_t a = px->rgba & 0xff;
+		if (a == 0xff) {
+			canvas_kernel_rgb(ptr, px->rgba);
+		} else if (a) {
+			canvas_kernel_rgb_blend(ptr, px->rgba);
+		} else {
+			continue;
+		}
+		canvas_layer_mark(layer, x, y);
+	}
+}
+
+void canvas_set_tile(unsigned int tx, unsigned int ty, const uint8_t* records, unsigned int n) {
+	CanvasLayer* layer = canvas_base;
+	unsigned int x0 = tx * CANVAS_TILE_SIZE, y0 = ty * CANVAS_TILE_SIZE;
+	if (tx >= layer->tiles_x || ty >= layer->tiles_y || n == 0) return;
+
+	// Clipped once per tile, only the last column and row of tiles can be partial
+	unsigned int w = layer->width - x0 < CANVAS_TILE_SIZE ? layer->width - x0 : CANVAS_TILE_SIZE;
+	unsigned int h = layer->height - y0 < CANVAS_TILE_SIZE ? layer->height - y0 : CANVAS_TILE_SIZE;
+	uint8_t* data = layer->data + y0 * layer->stride + x0 * 3;
+	unsigned int count;
+	uint64_t rows;
+	if (w == CANVAS_TILE_SIZE && h == CANVAS_TILE_SIZE) {
+		rows = canvas_tile_write(data, layer->stride, records, n, 0, w, h, &count);
+	} else {
+		rows = canvas_tile_write(data, layer->stride, records, n, 1, w, h, &count);
+	}
+	if (!count) return;
+	heatmap_count_tile(tx, ty, count);
+
+	if (layer->changed) {
+		uint8_t* changed = layer->changed + (size_t)y0 * layer->width + x0;
+		for (const uint8_t* rec = records; rec < records + n * CANVAS_TILE_RECORD;
+				 rec += CANVAS_TILE_RECORD) {
+			unsigned int pos = (rec[0] | rec[1] << 8) & (CANVAS_TILE_SIZE * CANVAS_TILE_SIZE - 1);
+			unsigned int x = pos % CANVAS_TILE_SIZE, y = pos / CANVAS_TILE_SIZE;
+			if (x < w && y < h) changed[(size_t)y * layer->width + x] = 1;
+		}
+		layer->changed_tiles[ty * layer->tiles_x + tx] = 1;
+	}
+	for (; rows; rows &= rows - 1) canvas_layer_mark_row(layer, y0 + __builtin_ctzll(rows));
+}
+
+void canvas_fill(uint32_t rgba) {
+	CanvasLayer* layer = canvas_base;
+	canvas_layer_rect(layer, 0, 0, layer->width, layer->height, rgba);
+}
+
+void canvas_overlay_set_px(unsigned int x, unsigned int y, uint32_t rgba) {
+	canvas_layer_set_px(canvas_overlay, x, y, rgba);
+}
+
+void canvas_overlay_rect(unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+												 uint32_t rgba) {
+	canvas_layer_rect(canvas_overlay, x, y, w, h, rgba);
+}
+
+void canvas_get_px(unsigned int x, unsigned int y, uint32_t* rgba) {
+	CanvasLayer* layer = canvas_base;
+	uint8_t* ptr = canvas_offset(layer, x, y);
+	if (ptr == NULL) {
+		*rgba = 0x000000;
+	} else {
+		*rgba = (ptr[0] << 24) + (ptr[1] << 16) + (ptr[2] << 8) + 0xff;
+	}
+}
+
+void canvas_get_size(unsigned int* w, unsigned int* h) {
+	*w = canvas_base->width;
+	*h = canvas_base->height;
+}
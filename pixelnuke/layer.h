@@ -0,0 +1,68 @@
+#ifndef LAYER_H_
+#define LAYER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Pixel store shared by all canvas backends. Not part of the public canvas API.
+
+// Rows are padded to a multiple of this many bytes, so each row starts cache line (and SIMD)
+// aligned.
+#define CANVAS_ROW_ALIGN 64
+
+// Edge length of the square tiles used for change tracking
+#define CANVAS_TILE_SIZE 64
+// Size of a pixel record for canvas_set_tile()
+#define CANVAS_TILE_RECORD 5
+
+typedef struct CanvasLayer {
+	unsigned int width;
+	unsigned int height;
+	// Bytes per row, including padding
+	size_t stride;
+	// 1 for RGBA layers (overlay), 0 for RGB layers (base)
+	int alpha;
+	// Bytes per pixel, 3 or 4
+	unsigned int bpp;
+	// Backend specific handles (e.g. OpenGL texture and PBOs), unused by the pixel store itself
+	unsigned int tex;
+	unsigned int pbo1;
+	unsigned int pbo2;
+	uint8_t* data;
+	size_t mem;
+	// memfd backing data (Linux only, -1 if data is plain heap memory)
+	int fd;
+	// Set by writers whenever data changes, cleared by the backend once it picked up the change.
+	volatile int dirty;
+	// Same as dirty, but per row. Backends that copy partial frames clear these individually.
+	uint8_t* dirty_rows;
+	// Optional change tracking for relaying (NULL if disabled): One byte per pixel (width * height,
+	// not padded) and one byte per tile, set on each write and cleared by whoever consumes them.
+	uint8_t* changed;
+	uint8_t* changed_tiles;
+	unsigned int tiles_x;
+	unsigned int tiles_y;
+} CanvasLayer;
+
+extern CanvasLayer* canvas_base;
+extern CanvasLayer* canvas_overlay;
+
+CanvasLayer* canvas_layer_alloc(unsigned int width, unsigned int height, int alpha);
+void canvas_layer_free(CanvasLayer* layer);
+
+// Replace the pixel data with a mapping of fd, a memfd of another layer with the same size and
+// format (see CanvasLayer.fd). Takes ownership of fd on success. Returns 0 if fd does not fit.
+int canvas_layer_adopt(CanvasLayer* layer, int fd);
+
+// Start tracking which pixels changed, see CanvasLayer.changed
+void canvas_layer_track_changes(CanvasLayer* layer);
+
+// Mark the whole layer as changed, e.g. after the backend lost its copy of the pixel data.
+void canvas_layer_touch(CanvasLayer* layer);
+
+// Draw n opaque pixels to tile (tx, ty) of the base layer. Each record is CANVAS_TILE_RECORD bytes:
+// Position within the tile (uint16 little endian, y * CANVAS_TILE_SIZE + x, modulo the tile area),
+// r, g, b. Records outside of the canvas are skipped.
+void canvas_set_tile(unsigned int tx, unsigned int ty, const uint8_t* records, unsigned int n);
+
+#endif /* LAYER_H_ */
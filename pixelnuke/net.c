@@ -5,6 +5,7 @@
 #include <errno.h>
 
 #include "canvas.h"
+#include "heatmap.h"
 // #include <event2/buffer.h>
 // #include <event2/bufferevent.h>
 // #include <event2/event.h>
@@ -27,11 +28,36 @@
 // Higher values increase throughput but fast clients might be able to draw large batches at once.
 #define NET_MAX_BUFFER 10240
 
+// Responses are collected per read callback and written in one go. If a client does not read its
+// responses, we stop reading its requests as soon as more than NET_WRITE_HIGH bytes are queued, and
+// continue once the queue drained below NET_WRITE_LOW. Clients that manage to queue more than
+// NET_WRITE_MAX bytes anyway are disconnected.
+#define NET_WRITE_LOW (64 * 1024)
+#define NET_WRITE_HIGH (256 * 1024)
+#define NET_WRITE_MAX (4 * 1024 * 1024)
+
 #define NET_CSTATE_OPEN 0
 #define NET_CSTATE_CLOSING 1
 
 static inline int min(int a, int b) { return a < b ? a : b; }
 
+// Per-connection state. The TCP handle comes first, so a NetClient* is also a valid uv_stream_t*.
+struct NetClient {
+	uv_tcp_t tcp;
+	int state;
+	// Set after a successful AUTH command, unlocks the admin commands (PX2, RECT2)
+	int admin;
+	// Set while reading is paused because too many responses are queued
+	int paused;
+	// Responses not yet handed to libuv
+	char* out;
+	size_t out_len;
+	size_t out_size;
+	// Pixel budget for rate limiting, refilled at net_rate_limit pixels per second
+	double tokens;
+	uint64_t refilled;
+};
+
 // global state
 // static struct event_base *base;
 // static char *line_buffer;
@@ -41,13 +67,59 @@ static net_on_connect netcb_on_connect = NULL;
 static net_on_read netcb_on_read = NULL;
 static net_on_close netcb_on_close = NULL;
 
+// Admin commands are disabled as long as no password is set
+static char* net_admin_password = NULL;
+
+// Max pixels per second and client, 0 for no limit. PX commands beyond the limit are dropped.
+static unsigned int net_rate_limit = 0;
+
+// UDP ingest: Each datagram contains complete PX commands. There is no per-client state and no
+// line reassembly across datagrams. Datagrams are either ASCII ('PX <x> <y> <color>' lines, all
+// other commands are ignored) or binary: NET_UDP_MAGIC followed by NET_UDP_RECORD byte records of
+// x (uint16, little endian), y (uint16, little endian), r, g, b, a.
+#define NET_UDP_MAGIC "PB"
+#define NET_UDP_RECORD 8
+// Binary records are decoded and drawn in batches of this many pixels
+#define NET_UDP_BATCH_PX 256
+// Datagrams received per recvmmsg() call. libuv splits the receive buffer into one 64KiB slot per
+// datagram.
+#define NET_UDP_BATCH 20
+#define NET_UDP_SLOT (64 * 1024)
+// Kernel receive buffer per socket, absorbs bursts while the loop is busy with TCP clients
+#define NET_UDP_RCVBUF (4 * 1024 * 1024)
+
+typedef struct NetUdp {
+	uv_udp_t udp;
+	// Receive buffer, reused for every batch
+	char* buf;
+} NetUdp;
+
 typedef struct NetThreadArguments {
 	int port;
+	int udp_port;
 	int id;
 	uv_loop_t* loop;
 	uv_tcp_t* server;
+	NetUdp* udp;
+	// Listening sockets, -1 until the thread is up (or if it has no UDP socket)
+	int tcp_fd;
+	int udp_fd;
+	// Signalled by net_stop_listening()
+	uv_async_t stop;
 } NetThreadArguments;
 
+// All network threads, for net_get_listeners() and net_stop_listening()
+static NetThreadArguments** net_threads = NULL;
+static int net_thread_count = 0;
+
+// Listening sockets handed over by a previous process, see net_adopt_listeners()
+static int* net_adopted_tcp = NULL;
+static int* net_adopted_udp = NULL;
+static int net_adopted_count = 0;
+
+// Connected TCP clients across all threads
+static unsigned int net_client_total = 0;
+
 // Helper functions
 
 static inline int fast_str_startswith(const char* prefix, const char* str) {
@@ -83,6 +155,53 @@ static inline uint32_t fast_strtoul16(const char* str, const char** endptr) {
 	return result;
 }
 
+// Parse a BB, RRGGBB or RRGGBBAA hex color into RGBA. Returns 0 on error.
+static inline int net_parse_color(const char* str, const char** endptr, uint32_t* rgba) {
+	uint32_t c = fast_strtoul16(str, endptr);
+	switch (*endptr - str) {
+		case 6:	 // RGB -> RGBA (most common)
+			*rgba = (c << 8) + 0xff;
+			return 1;
+		case 8:	 // done
+			*rgba = c;
+			return 1;
+		case 2:	 // WW -> RGBA
+			*rgba = (c << 24) + (c << 16) + (c << 8) + 0xff;
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+#define NET_PX_INVALID 0
+#define NET_PX_GET 1
+#define NET_PX_SET 2
+
+// Parse the arguments of a PX command, either '<x> <y>' (NET_PX_GET) or '<x> <y> <color>'
+// (NET_PX_SET). Returns NET_PX_INVALID on errors. *endptr points behind the last argument.
+static inline int net_parse_px(const char* ptr, const char** endptr, uint32_t* x, uint32_t* y,
+															 uint32_t* rgba) {
+	*x = fast_strtoul10(ptr, endptr);
+	if (*endptr == ptr || **endptr == '\0') return NET_PX_INVALID;
+
+	ptr = *endptr + 1;	// eat space (or whatever non-decimal is found here)
+	*y = fast_strtoul10(ptr, endptr);
+	if (*endptr == ptr) return NET_PX_INVALID;
+
+	if (**endptr == '\0' || **endptr == '\n' || **endptr == '\r') return NET_PX_GET;
+
+	if (!net_parse_color(*endptr + 1, endptr, rgba)) return NET_PX_INVALID;
+	return NET_PX_SET;
+}
+
+// Compare two strings in time independent of the position of the first mismatch.
+static int net_password_equals(const char* expected, const char* given) {
+	size_t len = strlen(expected);
+	unsigned char diff = strlen(given) != len;
+	for (size_t i = 0; i < len && given[i]; i++) diff |= expected[i] ^ given[i];
+	return diff == 0;
+}
+
 // libevent callbacks
 
 uv_buf_t uv_buf_from_str(const char* str) {
@@ -99,64 +218,172 @@ uv_buf_t uv_buf_from_str_with_length(const char* str, int length) {
 	return buf;
 }
 
+void on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf);
+void alloc_buffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
+
+static void net_on_write(uv_write_t* req, int status) {
+	NetClient* client = (NetClient*)req->handle->data;
+	free(req->data);
+	free(req);
+
+	// Write callbacks run before the close callback, so the client is still valid here
+	if (client->paused && client->state == NET_CSTATE_OPEN &&
+			uv_stream_get_write_queue_size((uv_stream_t*)&client->tcp) <= NET_WRITE_LOW) {
+		client->paused = 0;
+		uv_read_start((uv_stream_t*)&client->tcp, alloc_buffer, on_read);
+	}
+}
+
+static void net_on_client_close(uv_handle_t* handle) {
+	NetClient* client = (NetClient*)handle->data;
+	free(client->out);
+	free(client);
+	__atomic_sub_fetch(&net_client_total, 1, __ATOMIC_RELAXED);
+}
+
+// Append to the output buffer of a client. Call net_flush() to actually send it.
+static void net_queue(NetClient* client, const char* data, size_t len) {
+	if (client->state != NET_CSTATE_OPEN) return;
+
+	if (client->out_len + len > client->out_size) {
+		size_t size = client->out_size ? client->out_size : 1024;
+		while (size < client->out_len + len) size *= 2;
+		client->out = realloc(client->out, size);
+		client->out_size = size;
+	}
+	memcpy(client->out + client->out_len, data, len);
+	client->out_len += len;
+}
+
+// Hand the output buffer of a client over to libuv and enforce the write queue limits.
+static void net_flush(NetClient* client) {
+	if (client->state != NET_CSTATE_OPEN || client->out_len == 0) return;
+
+	uv_stream_t* stream = (uv_stream_t*)&client->tcp;
+	uv_write_t* req = (uv_write_t*)malloc(sizeof(uv_write_t));
+	req->data = client->out;
+	uv_buf_t res = uv_buf_from_str_with_length(client->out, client->out_len);
+	client->out = NULL;
+	client->out_len = client->out_size = 0;
+
+	int r = uv_write(req, stream, &res, 1, net_on_write);
+	if (r != 0) {
+		printf("Error during write %d\n", r);
+		free(req->data);
+		free(req);
+		return;
+	}
+
+	size_t queued = uv_stream_get_write_queue_size(stream);
+	if (queued > NET_WRITE_MAX) {
+		printf("Client does not read its responses (%zu bytes queued), disconnecting\n", queued);
+		net_close(client);
+	} else if (queued > NET_WRITE_HIGH && !client->paused) {
+		client->paused = 1;
+		uv_read_stop(stream);
+	}
+}
+
 // Public functions
 
 // void net_stop() { uv_loop_close(loop); }
 
+void net_set_admin_password(const char* password) {
+	free(net_admin_password);
+	net_admin_password = password && *password ? strdup(password) : NULL;
+}
+
+const char* net_get_admin_password() { return net_admin_password; }
+
+int net_check_admin_password(const char* password) {
+	return net_admin_password && net_password_equals(net_admin_password, password);
+}
+
+void net_set_rate_limit(unsigned int pixels_per_second) { net_rate_limit = pixels_per_second; }
+
+void net_adopt_listeners(const int* tcp_fds, const int* udp_fds, int count) {
+	net_adopted_tcp = malloc(count * sizeof(int));
+	net_adopted_udp = malloc(count * sizeof(int));
+	memcpy(net_adopted_tcp, tcp_fds, count * sizeof(int));
+	memcpy(net_adopted_udp, udp_fds, count * sizeof(int));
+	net_adopted_count = count;
+}
+
+int net_get_listeners(int* tcp_fds, int* udp_fds, int max) {
+	int n = 0;
+	for (int i = 0; i < net_thread_count && n < max; i++) {
+		if (net_threads[i]->tcp_fd < 0) continue;
+		tcp_fds[n] = net_threads[i]->tcp_fd;
+		udp_fds[n] = net_threads[i]->udp_fd;
+		n++;
+	}
+	return n;
+}
+
+void net_stop_listening() {
+	for (int i = 0; i < net_thread_count; i++) {
+		if (net_threads[i]->tcp_fd >= 0) uv_async_send(&net_threads[i]->stop);
+	}
+}
+
+unsigned int net_client_count() { return __atomic_load_n(&net_client_total, __ATOMIC_RELAXED); }
+
+void net_send(NetClient* client, const char* msg) {
+	net_queue(client, msg, strlen(msg));
+	net_queue(client, "\n", 1);
+}
+
+void net_close(NetClient* client) {
+	if (client->state != NET_CSTATE_OPEN) return;
+	client->state = NET_CSTATE_CLOSING;
+	uv_read_stop((uv_stream_t*)&client->tcp);
+	// Pending writes are cancelled and their callbacks run before the close callback
+	uv_close((uv_handle_t*)&client->tcp, net_on_client_close);
+}
+
+void net_err(NetClient* client, const char* msg) {
+	char str[NET_MAX_LINE];
+	snprintf(str, sizeof(str), "ERROR %s", msg);
+	net_send(client, str);
+	net_flush(client);
+	net_close(client);
+}
+
 void alloc_buffer(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
 	buf->base = malloc(suggested_size);
 	buf->len = suggested_size;
 }
 
 void handle_size_command(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
-	uv_write_t* req = (uv_write_t*)malloc(sizeof(uv_write_t));
-
 	printf("Handling SIZE command\n");
 
-	// TODO: actually read canvas size
 	unsigned int width, height;
 	canvas_get_size(&width, &height);
-	char str[64] = {0};
-	snprintf(str, 64, "SIZE %d %d\n", width, height);
-	uv_buf_t res = uv_buf_from_str_with_length((const char*)&str, 64);
-
-	// only need a single write
-	int r = uv_write(req, stream, &res, 1, NULL);
-	if (r != 0) {
-		printf("Error during SIZE command %d\n", r);
-	}
+	char str[64];
+	snprintf(str, sizeof(str), "SIZE %u %u", width, height);
+	net_send((NetClient*)stream->data, str);
 }
 
 void handle_stats_command(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
-	uv_write_t* req = (uv_write_t*)malloc(sizeof(uv_write_t));
-
-	printf("Handling SIZE command\n");
-
-	// TODO: actually read stats
-	char str[64] = {0};
-	snprintf(str, 64, "STATS px:%u conn:%u\n", 0, 0);
-	uv_buf_t res = uv_buf_from_str_with_length((const char*)&str, 64);
-
-	// only need a single write
-	int r = uv_write(req, stream, &res, 1, NULL);
-	if (r != 0) {
-		printf("Error during STATS command %d\n", r);
-	}
+	printf("Handling STATS command\n");
+
+	// TODO: actually read px stats
+	CanvasFrameStats frame;
+	canvas_get_frame_stats(&frame);
+	char str[128];
+	snprintf(str, sizeof(str),
+					 "STATS px:%u conn:%u frames:%lu fps:%.1f frame_avg_us:%.0f frame_max_us:%.0f", 0,
+					 net_client_count(), frame.frames, frame.fps, frame.frame_avg * 1e6,
+					 frame.frame_max * 1e6);
+	net_send((NetClient*)stream->data, str);
 }
 
 void handle_help_command(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
-	uv_write_t* req = (uv_write_t*)malloc(sizeof(uv_write_t));
-
 	printf("Handling HELP command\n");
 
-	char txt[] =
-			"PX x y: Get color at position (x,y)\nPX x y rrggbb(aa): Draw a pixel (with "
-			"optional alpha channel)\nSIZE: Get canvas size\nSTATS: Return statistics\n";
-	uv_buf_t res = uv_buf_from_str((const char*)&txt);
-	int r = uv_write(req, stream, &res, 1, NULL);
-	if (r != 0) {
-		printf("Error during HELP command %d\n", r);
-	}
+	net_send((NetClient*)stream->data,
+					 "PX x y: Get color at position (x,y)\nPX x y rrggbb(aa): Draw a pixel (with "
+					 "optional alpha channel)\nSIZE: Get canvas size\nSTATS: Return statistics");
 }
 
 void handle_reset_command(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
@@ -164,6 +391,79 @@ void handle_reset_command(uv_stream_t* stream, ssize_t nread, const uv_buf_t* bu
 	canvas_fill(0x000000ff);
 }
 
+// AUTH <password> -> Unlock admin commands for this connection
+static void handle_auth_command(NetClient* client, const char* password) {
+	if (!net_admin_password) {
+		net_err(client, "Admin commands are disabled");
+	} else if (!net_password_equals(net_admin_password, password)) {
+		net_err(client, "Wrong password");
+	} else {
+		client->admin = 1;
+		net_send(client, "AUTH OK");
+	}
+}
+
+// PX2 <x> <y> <rrggbb(aa)> -> Write a pixel to the overlay layer.
+// Returns a pointer behind the command or NULL on parse errors.
+static const char* handle_px2_command(NetClient* client, const char* ptr) {
+	const char* endptr;
+	uint32_t x = fast_strtoul10(ptr, &endptr);
+	if (endptr == ptr || *endptr != ' ') return NULL;
+	uint32_t y = fast_strtoul10((ptr = endptr + 1), &endptr);
+	if (endptr == ptr || *endptr != ' ') return NULL;
+	uint32_t c;
+	if (!net_parse_color(endptr + 1, &endptr, &c)) return NULL;
+
+	if (client->admin) canvas_overlay_set_px(x, y, c);
+	return endptr;
+}
+
+// RECT2 <x> <y> <w> <h> <rrggbb(aa)> -> Fill a rectangle on the overlay layer.
+// Returns a pointer behind the command or NULL on parse errors.
+static const char* handle_rect2_command(NetClient* client, const char* ptr) {
+	const char* endptr;
+	uint32_t v[4];
+	for (int i = 0; i < 4; i++) {
+		v[i] = fast_strtoul10(ptr, &endptr);
+		if (endptr == ptr || *endptr != ' ') return NULL;
+		ptr = endptr + 1;
+	}
+	uint32_t c;
+	if (!net_parse_color(ptr, &endptr, &c)) return NULL;
+
+	if (client->admin) canvas_overlay_rect(v[0], v[1], v[2], v[3], c);
+	return endptr;
+}
+
+// HEAT -> Write density per tile, in pixels per second and decayed over a few seconds. The first
+// line is 'HEAT <tiles_x> <tiles_y> <tile_size> <total> <max> <max_x> <max_y>' (max is the rate of
+// the hottest tile), followed by one line per row of tiles with the rate of each tile.
+static void handle_heat_command(NetClient* client) {
+	HeatmapStats stats;
+	float* rates = malloc((size_t)heatmap_tiles_x * heatmap_tiles_y * sizeof(float));
+	heatmap_sample(rates, &stats);
+
+	char str[128];
+	snprintf(str, sizeof(str), "HEAT %u %u %u %.0f %.0f %u %u", heatmap_tiles_x, heatmap_tiles_y,
+					 CANVAS_TILE_SIZE, stats.total, stats.max, stats.max_x, stats.max_y);
+	net_send(client, str);
+
+	// Rates are clamped to 32 bit, so up to 10 digits and a separator per tile
+	char* line = malloc(heatmap_tiles_x * 11 + 1);
+	for (unsigned int ty = 0; ty < heatmap_tiles_y; ty++) {
+		int len = 0;
+		for (unsigned int tx = 0; tx < heatmap_tiles_x; tx++) {
+			double rate = rates[ty * heatmap_tiles_x + tx];
+			unsigned int r = rate < UINT32_MAX ? (unsigned int)(rate + 0.5) : UINT32_MAX;
+			len += sprintf(line + len, tx ? " %u" : "%u", r);
+		}
+		net_send(client, line);
+	}
+
+	free(line);
+	free(rates);
+}
+
 /**
  * What should the flow of handing commands be?
  *
@@ -183,25 +483,43 @@ void handle_reset_command(uv_stream_t* stream, ssize_t nread, const uv_buf_t* bu
  * we can respond with an actual parser error message.
  */
 void on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+	NetClient* client = (NetClient*)stream->data;
+
 	if (nread < 0) {
 		if (nread != UV_EOF) {
 			// Some error that I don't care about atm
 		}
 
 		// Always close the stream
-		uv_close((uv_handle_t*)stream, NULL);
+		free(buf->base);
+		net_close(client);
+		return;
+	}
+
+	if (nread == 0) {
+		// Nothing to read right now (EAGAIN)
+		free(buf->base);
 		return;
 	}
 
 	printf("received %d bytes\n", nread);
 
+	if (net_rate_limit) {
+		// Refill the budget for the time since the last read, allowing bursts of up to one second
+		uint64_t now = uv_now(stream->loop);
+		client->tokens += (double)(now - client->refilled) * net_rate_limit / 1000;
+		if (client->tokens > net_rate_limit) client->tokens = net_rate_limit;
+		client->refilled = now;
+	}
+
 	char* start = buf->base;
 	char* end = &buf->base[nread - 1];
 
 	// TODO: only keep parsing when the initial bytes looks like PX commands
 	// We can actually send multiple buffers
 	// https://ant.readthedocs.io/en/latest/stream.html#c.uv_write
-	while (start != end) {
+	// Errors close the client, nothing after them must be executed
+	while (start != end && client->state == NET_CSTATE_OPEN) {
 		while (*start == 10 || *start == 13 || *start == 0) {
 			start++;
 		}
@@ -212,75 +530,70 @@ void on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
 		if (fast_str_startswith("PX ", start)) {
 			printf("Handling PX command\n");
 
-			uv_write_t* req = (uv_write_t*)malloc(sizeof(uv_write_t));
+			uint32_t x, y, c;
+			const char* endptr;
+			int cmd = net_parse_px(start + 3, &endptr, &x, &y, &c);
 
-			const char* ptr = start + 3;
-			const char* endptr = ptr;
-			errno = 0;
+			// PX <x> <y> -> Get RGB color at position (x,y) or '0x000000' for out-of-range queries
+			if (cmd == NET_PX_GET) {
+				canvas_get_px(x, y, &c);
+				char str[64];
+				int len = snprintf(str, sizeof(str), "PX %u %u %06X\n", x, y, (c >> 8));
+				net_queue(client, str, len);
 
-			uint32_t x = fast_strtoul10(ptr, &endptr);
-			if (endptr == ptr) {
-				// net_err(client, "Invalid command (expected decimal as first parameter)");
-				return;
+				if (endptr >= end) break;
+				start = (char*)endptr;
+				continue;
 			}
-			if (*endptr == '\0') {
-				// net_err(client, "Invalid command (second parameter required)");
-				return;
+
+			// PX <x> <y> BB|RRGGBB|RRGGBBAA
+			if (cmd != NET_PX_SET) {
+				puts("Invalid PX command (expected 'PX <x> <y>' or 'PX <x> <y> <ww|rrggbb|rrggbbaa>')");
+				break;
 			}
 
-			endptr++;	 // eat space (or whatever non-decimal is found here)
+			printf("Set pixel %d %d to 0x%08X \n", x, y, c);
 
-			uint32_t y = fast_strtoul10((ptr = endptr), &endptr);
-			if (endptr == ptr) {
-				// net_err(client, "Invalid command (expected decimal as second parameter)");
-				return;
+			// px_pixelcount++;
+			if (!net_rate_limit) {
+				canvas_set_px(x, y, c);
+			} else if (client->tokens >= 1) {
+				client->tokens--;
+				canvas_set_px(x, y, c);
 			}
 
-			// PX <x> <y> -> Get RGB color at position (x,y) or '0x000000' for out-of-range queries
-			// printf("endptr: %d, ptr: %d\n", *endptr, *ptr);
-			if (*endptr == '\0' || *endptr == '\n' || *endptr == 13) {
-				uint32_t c = 0x00000000;
-				canvas_get_px(x, y, &c);
-				char str[64] = {0};
-				snprintf(str, 64, "PX %u %u %06X\n", x, y, (c >> 8));
-				// TODO: build buffer instead of writing all the time
-				uv_buf_t res = uv_buf_from_str_with_length((const char*)&str, 64);
-				int r = uv_write(req, stream, &res, 1, NULL);
-				if (r != 0) {
-					printf("Error during PX command %d\n", r);
-				}
-				return;
+			start = (char*)endptr;
+		} else if (fast_str_startswith("PX2 ", start) || fast_str_startswith("RECT2 ", start)) {
+			if (!client->admin) {
+				net_err(client, "Admin commands require AUTH");
+				break;
 			}
 
-			endptr++;	 // eat space (or whatever non-decimal is found here)
-
-			// PX <x> <y> BB|RRGGBB|RRGGBBAA
-			uint32_t c = fast_strtoul16((ptr = endptr),
-																	&endptr);	 // advances endptr until the last non-hex character
-			if (endptr == ptr) {
-				puts("Third parameter missing or invalid (should be hex color)");
-				return;
+			const char* endptr = start[0] == 'P' ? handle_px2_command(client, start + 4)
+																					: handle_rect2_command(client, start + 6);
+			if (endptr == NULL) {
+				net_err(client, "Invalid admin command");
+				break;
 			}
 
-			if (endptr - ptr == 6) {
-				// RGB -> RGBA (most common)
-				c = (c << 8) + 0xff;
-			} else if (endptr - ptr == 8) {
-				// done
-			} else if (endptr - ptr == 2) {
-				// WW -> RGBA
-				c = (c << 24) + (c << 16) + (c << 8) + 0xff;
+			start = (char*)endptr;
+		} else if (fast_str_startswith("AUTH ", start)) {
+			// The password runs until the end of the line
+			char* eol = start + 5;
+			while (eol < buf->base + nread && *eol != '\n' && *eol != '\r') eol++;
+			char password[NET_MAX_LINE];
+			snprintf(password, sizeof(password), "%.*s", (int)(eol - start - 5), start + 5);
+			handle_auth_command(client, password);
+
+			if (eol >= end) break;
+			start = eol;
+		} else if (fast_str_startswith("HEAT", start)) {
+			if (!client->admin) {
+				net_err(client, "Admin commands require AUTH");
 			} else {
-				puts("Color hex code must be 2, 6 or 8 characters long (WW, RGB or RGBA)");
-				return;
+				handle_heat_command(client);
 			}
-
-			printf("Set pixel %d %d to 0x%08X \n", x, y, c);
-
-			// px_pixelcount++;
-			canvas_set_px(x, y, c);
-
-			start = endptr;
+			break;
 		} else if (fast_str_startswith("SIZE", start)) {
 			handle_size_command(stream, nread, buf);
 			break;
@@ -301,12 +614,23 @@ void on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
 		}
 	}
 
+	// All responses of this read go out in a single write
+	net_flush(client);
+
 	free(buf->base);
 	puts("Finished reading socket");
 }
 
 void on_connection(uv_stream_t* server, int status) {
-	uv_tcp_t* client = malloc(sizeof(uv_tcp_t));
+	NetClient* client = malloc(sizeof(NetClient));
+	client->state = NET_CSTATE_OPEN;
+	client->admin = 0;
+	client->paused = 0;
+	client->out = NULL;
+	client->out_len = client->out_size = 0;
+	client->tokens = net_rate_limit;
+	client->refilled = uv_now(server->loop);
+	__atomic_add_fetch(&net_client_total, 1, __ATOMIC_RELAXED);
 	// NetThreadArguments *ctx = (NetThreadArguments *)server->data;
 
 	// printf("new connection on thread %d\n", ctx->id);
@@ -316,24 +640,141 @@ void on_connection(uv_stream_t* server, int status) {
 	}
 
 	// uv_tcp_init(loop, client);
-	uv_tcp_init(server->loop, client);
+	uv_tcp_init(server->loop, &client->tcp);
+	client->tcp.data = client;
 
-	if (uv_accept(server, (uv_stream_t*)client) == 0) {
-		int r = uv_read_start((uv_stream_t*)client, alloc_buffer, on_read);
+	if (uv_accept(server, (uv_stream_t*)&client->tcp) == 0) {
+		int r = uv_read_start((uv_stream_t*)&client->tcp, alloc_buffer, on_read);
 
 		if (r) {
 			/* error */
 		}
 	} else {
-		uv_close((uv_handle_t*)client, NULL);
+		net_close(client);
+	}
+}
+
+// Draw all PX commands in a single datagram. The datagram must be followed by a \0 byte.
+static void net_udp_handle_datagram(const char* data, size_t len) {
+	if (len >= 2 && data[0] == NET_UDP_MAGIC[0] && data[1] == NET_UDP_MAGIC[1]) {
+		const uint8_t* rec = (const uint8_t*)data + 2;
+		CanvasPixel batch[NET_UDP_BATCH_PX];
+		size_t n = 0;
+		for (size_t left = (len - 2) / NET_UDP_RECORD; left > 0; left--, rec += NET_UDP_RECORD) {
+			batch[n].x = rec[0] | rec[1] << 8;
+			batch[n].y = rec[2] | rec[3] << 8;
+			batch[n].rgba = (uint32_t)rec[4] << 24 | rec[5] << 16 | rec[6] << 8 | rec[7];
+			if (++n == NET_UDP_BATCH_PX) {
+				canvas_set_px_batch(batch, n);
+				n = 0;
+			}
+		}
+		canvas_set_px_batch(batch, n);
+		return;
+	}
+
+	const char* end = data + len;
+	while (data < end) {
+		if (fast_str_startswith("PX ", data)) {
+			uint32_t x, y, c;
+			const char* endptr;
+			if (net_parse_px(data + 3, &endptr, &x, &y, &c) == NET_PX_SET) canvas_set_px(x, y, c);
+			data = endptr;
+		}
+		// Skip the rest of the line, including anything we did not understand
+		while (data < end && *data != '\n') data++;
+		data++;
+	}
+}
+
+static void net_udp_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+	NetUdp* udp = (NetUdp*)handle->data;
+	buf->base = udp->buf;
+	buf->len = NET_UDP_BATCH * NET_UDP_SLOT;
+}
+
+static void net_udp_on_recv(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf,
+														const struct sockaddr* addr, unsigned flags) {
+	// nread == 0 without addr means there is nothing (more) to read. The buffer is owned by NetUdp
+	// and reused, so UV_UDP_MMSG_FREE needs no special handling.
+	if (nread <= 0 || addr == NULL) return;
+
+	// Datagrams are at most 65507 bytes, so there is always room for a terminator in the slot
+	buf->base[nread] = '\0';
+	net_udp_handle_datagram(buf->base, nread);
+}
+
+static void net_udp_on_close(uv_handle_t* handle) {
+	NetUdp* udp = (NetUdp*)handle->data;
+	free(udp->buf);
+	free(udp);
+}
+
+// Bind a UDP socket to the given port and drain it on the loop of ctx. Every loop gets its own
+// socket with SO_REUSEPORT, so the kernel spreads datagrams across all network threads. If fd is
+// not -1, it is an already bound socket handed over by a previous process.
+static int net_udp_start(NetThreadArguments* ctx, int port, int fd) {
+	if (fd < 0) {
+		struct sockaddr_in addr;
+		uv_ip4_addr("0.0.0.0", port, &addr);
+
+		fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if (fd < 0) return -errno;
+
+		int one = 1, rcvbuf = NET_UDP_RCVBUF;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+		if (bind(fd, (const struct sockaddr*)&addr, sizeof(addr))) {
+			int r = -errno;
+			close(fd);
+			return r;
+		}
+	}
+
+	NetUdp* udp = malloc(sizeof(NetUdp));
+	// +1 for the terminator behind a full size datagram without recvmmsg
+	udp->buf = malloc(NET_UDP_BATCH * NET_UDP_SLOT + 1);
+	// AF_UNSPEC: Do not let libuv create a socket, uv_udp_open() adopts ours instead
+	uv_udp_init_ex(ctx->loop, &udp->udp, AF_UNSPEC | UV_UDP_RECVMMSG);
+	udp->udp.data = udp;
+
+	int r = uv_udp_open(&udp->udp, fd);
+	if (r != 0) {
+		// Not adopted, so closing the handle does not close it
+		close(fd);
+	} else {
+		r = uv_udp_recv_start(&udp->udp, net_udp_alloc, net_udp_on_recv);
+	}
+	if (r != 0) {
+		uv_close((uv_handle_t*)&udp->udp, net_udp_on_close);
+		return r;
+	}
+	ctx->udp = udp;
+	ctx->udp_fd = fd;
+
+	printf("Receiving UDP datagrams on port %d%s\n", port,
+				 uv_udp_using_recvmmsg(&udp->udp) ? " (recvmmsg)" : "");
+	return 0;
+}
+
+static void net_on_stop(uv_async_t* handle) {
+	NetThreadArguments* ctx = (NetThreadArguments*)handle->data;
+	// Connected clients are served until they disconnect, closing the listeners only stops new ones
+	uv_close((uv_handle_t*)ctx->server, NULL);
+	if (ctx->udp) {
+		uv_udp_recv_stop(&ctx->udp->udp);
+		uv_close((uv_handle_t*)&ctx->udp->udp, net_udp_on_close);
+		ctx->udp = NULL;
 	}
 }
 
 int start_uv_server(void* arg) {
 	// We assume we are running on our own thread at this opoint.
 	NetThreadArguments* ctx = (NetThreadArguments*)arg;
-	uv_loop_t* loop = uv_default_loop();
-	// ctx->loop = loop;
+	// Each thread needs its own loop, the default loop is not thread-safe
+	uv_loop_t* loop = malloc(sizeof(uv_loop_t));
+	uv_loop_init(loop);
+	ctx->loop = loop;
 
 	uv_tcp_t server;
 
@@ -346,13 +787,18 @@ int start_uv_server(void* arg) {
 	ctx->server = &server;
 	ctx->server->data = ctx;
 
+	if (ctx->id < net_adopted_count) {
+		// Keep accepting on the socket of the previous process, its backlog is not lost
+		uv_tcp_open(&server, net_adopted_tcp[ctx->id]);
+	} else {
 // uv_tcp_bind(&server, (const struct sockaddr *)&addr, UV_TCP_REUSEPORT);
 // libuv does not support UV_TCP_REUSEPORT under macOS
 #ifdef __APPLE__
-	uv_tcp_bind(&server, (const struct sockaddr*)&addr, 0);
+		uv_tcp_bind(&server, (const struct sockaddr*)&addr, 0);
 #else
-	uv_tcp_bind(&server, (const struct sockaddr*)&addr, UV_TCP_REUSEPORT);
+		uv_tcp_bind(&server, (const struct sockaddr*)&addr, UV_TCP_REUSEPORT);
 #endif
+	}
 
 	int r = uv_listen((uv_stream_t*)&server, 128, on_connection);
 
@@ -360,21 +806,44 @@ int start_uv_server(void* arg) {
 	if (r != 0) {
 		return r;
 	}
+	uv_fileno((uv_handle_t*)&server, &ctx->tcp_fd);
+
+	uv_async_init(loop, &ctx->stop, net_on_stop);
+	ctx->stop.data = ctx;
+
+	int udp_fd = ctx->id < net_adopted_count ? net_adopted_udp[ctx->id] : -1;
+	if (ctx->udp_port || udp_fd >= 0) {
+		r = net_udp_start(ctx, ctx->udp_port, udp_fd);
+		if (r != 0) {
+			printf("Could not listen on UDP port %d: %s\n", ctx->udp_port, uv_strerror(r));
+		}
+	}
 
 	return uv_run(loop, UV_RUN_DEFAULT);
 }
 
-void start_event_loops(int loop_count, int port) {
+void start_event_loops(int loop_count, int port, int udp_port) {
 	pthread_t net_thread[loop_count];
-	uv_tcp_t server[loop_count];
-	uv_loop_t* loop[loop_count];
+
+	// Sockets of a previous process that ran more threads than we do
+	for (int i = loop_count; i < net_adopted_count; i++) {
+		close(net_adopted_tcp[i]);
+		if (net_adopted_udp[i] >= 0) close(net_adopted_udp[i]);
+	}
+
+	net_threads = calloc(loop_count, sizeof(NetThreadArguments*));
+	net_thread_count = loop_count;
 
 	for (int i = 0; i < loop_count; i++) {
 		NetThreadArguments* args = (NetThreadArguments*)malloc(sizeof(NetThreadArguments));
 		args->port = port;
+		args->udp_port = udp_port;
 		args->id = i;
-		args->loop = loop[i];
-		args->server = &server[i];
+		args->loop = NULL;
+		args->server = NULL;
+		args->udp = NULL;
+		args->tcp_fd = args->udp_fd = -1;
+		net_threads[i] = args;
 
 		printf("Creating thread with id %d\n", i);
 		if (pthread_create(&net_thread[i], NULL, (void*)start_uv_server, args)) {
@@ -21,12 +21,38 @@ typedef void (*net_on_close)(NetClient *client, int error);
 // Start the server and block until it is closed again.
 // void net_start_secondary_thread(int port, int id);
 
-void start_event_loops(int loop_count, int port);
+// Start loop_count network threads accepting TCP connections on port. If udp_port is not 0, each
+// thread also draws PX commands received as UDP datagrams on that port.
+void start_event_loops(int loop_count, int port, int udp_port);
+
+// Set the password that unlocks admin commands via AUTH. NULL or "" disables admin commands.
+void net_set_admin_password(const char *password);
+// Get the admin password, or NULL if admin commands are disabled
+const char *net_get_admin_password();
+// Compare a password with the admin password in constant time. Always fails if none is set.
+int net_check_admin_password(const char *password);
+
+// Limit each client to this many pixels per second (with bursts of up to one second), further PX
+// commands are silently dropped. 0 disables the limit.
+void net_set_rate_limit(unsigned int pixels_per_second);
+
+// Restart support: Listening sockets of a previous process, one TCP and one UDP socket (or -1) per
+// network thread. Must be called before start_event_loops(), which uses them instead of binding
+// new sockets. Sockets beyond the number of threads are closed.
+void net_adopt_listeners(const int *tcp_fds, const int *udp_fds, int count);
+// Get the listening sockets of all running network threads (up to max), in the same format.
+// Returns the number of threads.
+int net_get_listeners(int *tcp_fds, int *udp_fds, int max);
+// Stop accepting new TCP connections and UDP datagrams. Connected clients are still served.
+void net_stop_listening();
+// Number of connected TCP clients
+unsigned int net_client_count();
 
 // Stop the server as soon as possible
 // void net_stop();
 
-// Send a string to the client. A newline is added automatically.
+// Send a string to the client. A newline is added automatically. Output is buffered and sent
+// after the current read callback, reading pauses while the client does not consume its responses.
 void net_send(NetClient *client, const char *msg);
 // Stop reading from this clients socket, send all bytes still in the output buffer, then close the
 // connection.
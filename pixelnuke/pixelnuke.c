@@ -1,15 +1,211 @@
 #include <errno.h>
+#include <getopt.h>
 #include <stdio.h>	//sprintf
 #include <stdlib.h>
+#include <string.h>
 
 #include "canvas.h"
+#include "handoff.h"
+#include "heatmap.h"
 #include "net.h"
+#include "relay.h"
 
+// Configuration, set via command line options or config files (see px_usage)
 unsigned int px_width = 1024;
 unsigned int px_height = 1024;
+unsigned int px_port = 1337;
+unsigned int px_udp_port = 0;
+unsigned int px_threads = 1;
+// Relay mode: Forward all changes to a display instance (edge) or accept them from edges (display)
+char px_relay_host[256] = "";
+unsigned int px_relay_port = 0;
+unsigned int px_relay_listen = 0;
+// Unix socket for zero-downtime restarts, NULL to disable
+char *px_handoff_path = NULL;
+
 unsigned int px_pixelcount = 0;
 unsigned int px_clientcount = 0;
 
+static const struct option px_options[] = {
+		{"config", required_argument, NULL, 'c'},
+		{"size", required_argument, NULL, 's'},
+		{"width", required_argument, NULL, 'W'},
+		{"height", required_argument, NULL, 'H'},
+		{"port", required_argument, NULL, 'p'},
+		{"udp-port", required_argument, NULL, 'u'},
+		{"threads", required_argument, NULL, 't'},
+		{"fps", required_argument, NULL, 'f'},
+		{"idle", required_argument, NULL, 'i'},
+		{"admin-password", required_argument, NULL, 'a'},
+		{"rate-limit", required_argument, NULL, 'l'},
+		{"relay-to", required_argument, NULL, 'r'},
+		{"relay-listen", required_argument, NULL, 'R'},
+		{"handoff-socket", required_argument, NULL, 'S'},
+		{"heat-overlay", required_argument, NULL, 'm'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0},
+};
+
+static void px_usage(const char *name) {
+	printf(
+			"Usage: %s [options]\n"
+			"\n"
+			"  -c, --config <file>           Read options from a file, one '<option> = <value>' per line\n"
+			"  -s, --size <w>x<h>            Canvas size in pixel (default: 1024x1024, max: %u)\n"
+			"      --width <w>               Canvas width in pixel\n"
+			"      --height <h>              Canvas height in pixel\n"
+			"  -p, --port <port>             TCP port to listen on (default: 1337)\n"
+			"  -u, --udp-port <port>         Also draw PX commands sent as UDP datagrams to this port\n"
+			"  -t, --threads <n>             Number of network threads (default: 1)\n"
+			"      --fps <fps|vsync>         Render at a fixed frame rate (default: vsync)\n"
+			"      --idle <on|off>           Stop rendering while nothing changes (default: on)\n"
+			"      --admin-password <pw>     Password for AUTH (default: $PIXELNUKE_ADMIN_PASSWORD)\n"
+			"      --rate-limit <px/s>       Max pixels per second and client (default: 0, unlimited)\n"
+			"      --relay-to <host>:<port>  Run headless and forward all changes to a display instance\n"
+			"      --relay-listen <port>     Accept changes from relay edges on this port\n"
+			"      --handoff-socket <path>   Take over from (and later hand over to) an instance\n"
+			"                                using the same socket, without dropping connections\n"
+			"      --heat-overlay <on|off>   Tint the canvas by write density (default: off)\n"
+			"  -h, --help                    Show this help\n",
+			name, CANVAS_MAX_SIZE);
+}
+
+// Parse a decimal number within [min, max]. Returns 0 on error.
+static int px_parse_uint(const char *str, unsigned int min, unsigned int max, unsigned int *out) {
+	char *end;
+	errno = 0;
+	unsigned long v = strtoul(str, &end, 10);
+	if (errno || end == str || *end != '\0' || v < min || v > max) return 0;
+	*out = v;
+	return 1;
+}
+
+static int px_parse_bool(const char *str, int *out) {
+	if (!strcmp(str, "on") || !strcmp(str, "yes") || !strcmp(str, "true") || !strcmp(str, "1")) {
+		*out = 1;
+	} else if (!strcmp(str, "off") || !strcmp(str, "no") || !strcmp(str, "false") ||
+						 !strcmp(str, "0")) {
+		*out = 0;
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+static int px_load_config(const char *path);
+
+// Apply a single option, given by its short option character. Returns 0 on invalid values.
+static int px_set_option(int opt, const char *value) {
+	int flag, len;
+	unsigned int n;
+
+	switch (opt) {
+		case 'c':
+			return px_load_config(value);
+		case 's':
+			if (sscanf(value, "%ux%u%n", &px_width, &px_height, &len) != 2 || value[len] != '\0')
+				return 0;
+			return px_width && px_height && px_width <= CANVAS_MAX_SIZE && px_height <= CANVAS_MAX_SIZE;
+		case 'W':
+			return px_parse_uint(value, 1, CANVAS_MAX_SIZE, &px_width);
+		case 'H':
+			return px_parse_uint(value, 1, CANVAS_MAX_SIZE, &px_height);
+		case 'p':
+			return px_parse_uint(value, 1, 65535, &px_port);
+		case 'u':
+			return px_parse_uint(value, 0, 65535, &px_udp_port);
+		case 't':
+			return px_parse_uint(value, 1, 256, &px_threads);
+		case 'f':
+			if (!strcmp(value, "vsync")) {
+				canvas_set_fps(0);
+				return 1;
+			}
+			if (!px_parse_uint(value, 1, 1000, &n)) return 0;
+			canvas_set_fps(n);
+			return 1;
+		case 'i':
+			if (!px_parse_bool(value, &flag)) return 0;
+			canvas_set_idle(flag);
+			return 1;
+		case 'a':
+			net_set_admin_password(value);
+			return 1;
+		case 'l':
+			if (!px_parse_uint(value, 0, 1000000000, &n)) return 0;
+			net_set_rate_limit(n);
+			return 1;
+		case 'r': {
+			const char *colon = strrchr(value, ':');
+			len = colon ? colon - value : 0;
+			if (len == 0 || len >= (int)sizeof(px_relay_host)) return 0;
+			memcpy(px_relay_host, value, len);
+			px_relay_host[len] = '\0';
+			return px_parse_uint(colon + 1, 1, 65535, &px_relay_port);
+		}
+		case 'R':
+			return px_parse_uint(value, 0, 65535, &px_relay_listen);
+		case 'm':
+			if (!px_parse_bool(value, &flag)) return 0;
+			heatmap_set_overlay(flag);
+			return 1;
+		case 'S':
+			free(px_handoff_path);
+			px_handoff_path = *value ? strdup(value) : NULL;
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+// Config files contain one option per line as '<long option name> = <value>'. Empty lines and
+// lines starting with '#' are ignored. Returns 0 on errors.
+static int px_load_config(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		printf("Could not open config file %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	char line[1024];
+	int lineno = 0, ok = 1;
+	while (ok && fgets(line, sizeof(line), f)) {
+		lineno++;
+
+		char *key = line + strspn(line, " \t");
+		key[strcspn(key, "\r\n")] = '\0';
+		if (*key == '\0' || *key == '#') continue;
+
+		char *eq = strchr(key, '=');
+		if (!eq) {
+			printf("%s:%d: Expected '<option> = <value>'\n", path, lineno);
+			ok = 0;
+			break;
+		}
+
+		char *value = eq + 1 + strspn(eq + 1, " \t");
+		char *end = eq;
+		while (end > key && (end[-1] == ' ' || end[-1] == '\t')) end--;
+		*end = '\0';
+		end = value + strlen(value);
+		while (end > value && (end[-1] == ' ' || end[-1] == '\t')) end--;
+		*end = '\0';
+
+		const struct option *o = px_options;
+		while (o->name && strcmp(o->name, key)) o++;
+		if (!o->name || o->val == 'c' || o->val == 'h') {
+			printf("%s:%d: Unknown option '%s'\n", path, lineno, key);
+			ok = 0;
+		} else if (!px_set_option(o->val, value)) {
+			printf("%s:%d: Invalid value for '%s': %s\n", path, lineno, key, value);
+			ok = 0;
+		}
+	}
+
+	fclose(f);
+	return ok;
+}
+
 void px_on_key(int key, int scancode, int mods) {
 	printf("Key pressed: key:%d scancode:%d mods:%d\n", key, scancode, mods);
 
@@ -28,8 +224,6 @@ void px_on_key(int key, int scancode, int mods) {
 	}
 }
 
-void px_on_resize() { canvas_get_size(&px_width, &px_height); }
-
 void px_on_window_close() {
 	printf("Window closed\n");
 	// net_stop();
@@ -37,17 +231,47 @@ void px_on_window_close() {
 
 int main(int argc, char **argv) {
 	// canvas_setcb_key(&px_on_key);
-	canvas_setcb_resize(&px_on_resize);
 
-	// net_start_secondary_thread(1337, &px_on_connect, &px_on_read, &px_on_close);
-	// net_start_secondary_thread(1337, 0);
-	int loop_count = 1;
+	net_set_admin_password(getenv("PIXELNUKE_ADMIN_PASSWORD"));
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "c:s:p:u:t:h", px_options, NULL)) != -1) {
+		if (opt == 'h') {
+			px_usage(argv[0]);
+			return 0;
+		}
+		if (opt == '?' || !px_set_option(opt, optarg)) {
+			if (opt != '?') printf("Invalid value for option: %s\n", optarg);
+			px_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	int loop_count = px_threads;
 
 #ifdef __APPLE__
 	loop_count = 1;
 #endif
 
-	start_event_loops(loop_count, 1337);
+	if ((px_relay_port || px_relay_listen) && !net_get_admin_password()) {
+		puts("Relay mode requires an admin password, which edges use to authenticate");
+		return 1;
+	}
+
+	// Take over the sockets and pixels of a running instance, which then exits
+	if (px_handoff_path) handoff_receive(px_handoff_path);
+
+	canvas_init(px_width, px_height);
+	handoff_adopt();
+	start_event_loops(loop_count, px_port, px_udp_port);
+	if (px_handoff_path) handoff_listen(px_handoff_path);
+
+	if (px_relay_port) {
+		// Edges never open a window, the display instance renders for them
+		relay_run_edge(px_relay_host, px_relay_port);
+		return 1;
+	}
+	if (px_relay_listen) relay_start_display(px_relay_listen);
 
 	// The OpenGL implementation in macOS' Cocoa only receives window and input events
 	// and only allows most window and input actions to be executed on the main thread instead
@@ -55,7 +279,8 @@ int main(int argc, char **argv) {
 	// we move the canvas rendering logic onto the main thread and the network code
 	// runs in a separately spawned stack.
 	// See https://discourse.glfw.org/t/multithreading-glfw/573/4
-	canvas_start(1024, &px_on_window_close);
+	canvas_start(&px_on_window_close);
+	handoff_finish();
 
 	return 0;
 }
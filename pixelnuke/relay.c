@@ -0,0 +1,424 @@
+#include "relay.h"
+
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+#include "canvas.h"
+#include "layer.h"
+#include "net.h"
+
+// Wire format (edge -> display), all integers are little endian:
+//
+// 1. Handshake: The ASCII line "RELAY <width> <height> <admin password>\n". The display closes the
+//    connection if the size does not match its own canvas or the password is wrong. Edges then
+//    send their whole canvas once, so nothing lost with a previous connection stays missing.
+// 2. Any number of tile deltas: RELAY_MAGIC, tile column (uint16), tile row (uint16) and the
+//    number of pixels n (uint16), followed by n records of RELAY_RECORD bytes: position within the
+//    tile (uint16, y * CANVAS_TILE_SIZE + x), r, g, b.
+//
+// A delta carries the current color of each pixel that changed since the last delta. Multiple
+// writes to a pixel between two deltas are sent only once. If several edges write to the same
+// pixel, the edge whose delta arrives last wins.
+
+#define RELAY_MAGIC "TD"
+#define RELAY_HEADER 8
+#define RELAY_RECORD CANVAS_TILE_RECORD
+#define RELAY_MAX_DELTA (RELAY_HEADER + CANVAS_TILE_SIZE * CANVAS_TILE_SIZE * RELAY_RECORD)
+
+// How often edges send their changes, in milliseconds
+#define RELAY_INTERVAL 20
+// Edges skip sending while more than this many bytes are still queued for the display. Changes
+// keep accumulating (and coalescing) in the change map until the display caught up.
+#define RELAY_MAX_QUEUE (4 * 1024 * 1024)
+// Delay between reconnect attempts, in milliseconds
+#define RELAY_RECONNECT 1000
+// Max length of the handshake line, including the password. Also the receive buffer size of edge
+// connections until they are authenticated.
+#define RELAY_MAX_HANDSHAKE 1024
+// Edges that did not complete the handshake within this many milliseconds are disconnected
+#define RELAY_HANDSHAKE_TIMEOUT 5000
+// Receive buffer per edge connection on the display. Must hold at least two deltas.
+#define RELAY_READ_BUFFER (4 * RELAY_MAX_DELTA)
+
+static inline unsigned int min(unsigned int a, unsigned int b) { return a < b ? a : b; }
+
+static inline void relay_put16(uint8_t* p, unsigned int v) {
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static inline unsigned int relay_get16(const uint8_t* p) { return p[0] | p[1] << 8; }
+
+// Edge
+
+typedef struct RelayEdge {
+	uv_loop_t loop;
+	uv_timer_t timer;
+	struct sockaddr_storage addr;
+	// NULL while disconnected
+	uv_tcp_t* conn;
+	int connected;
+	uint64_t next_connect;
+} RelayEdge;
+
+static RelayEdge relay_edge;
+
+static void relay_edge_connect();
+
+static void relay_on_write(uv_write_t* req, int status) {
+	free(req->data);
+	free(req);
+}
+
+static void relay_edge_on_close(uv_handle_t* handle) {
+	free(handle);
+	relay_edge.next_connect = uv_now(&relay_edge.loop) + RELAY_RECONNECT;
+}
+
+static void relay_edge_disconnect() {
+	if (!relay_edge.conn) return;
+	uv_close((uv_handle_t*)relay_edge.conn, relay_edge_on_close);
+	relay_edge.conn = NULL;
+	relay_edge.connected = 0;
+}
+
+static void relay_edge_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+	static char discard[256];
+	buf->base = discard;
+	buf->len = sizeof(discard);
+}
+
+// The display never sends anything, reading only tells us when the connection is gone.
+static void relay_edge_on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+	if (nread < 0) {
+		printf("Lost connection to relay display: %s\n", uv_strerror(nread));
+		relay_edge_disconnect();
+	}
+}
+
+static void relay_edge_send(void* data, size_t len) {
+	uv_write_t* req = malloc(sizeof(uv_write_t));
+	req->data = data;
+	uv_buf_t buf = {.base = data, .len = len};
+	if (uv_write(req, (uv_stream_t*)relay_edge.conn, &buf, 1, relay_on_write)) {
+		free(data);
+		free(req);
+		relay_edge_disconnect();
+	}
+}
+
+static void relay_edge_on_connect(uv_connect_t* req, int status) {
+	free(req);
+	if (status < 0) {
+		printf("Could not connect to relay display: %s\n", uv_strerror(status));
+		relay_edge_disconnect();
+		return;
+	}
+
+	printf("Connected to relay display\n");
+	relay_edge.connected = 1;
+	uv_read_start((uv_stream_t*)relay_edge.conn, relay_edge_alloc, relay_edge_on_read);
+
+	unsigned int width, height;
+	canvas_get_size(&width, &height);
+	char* hello = malloc(RELAY_MAX_HANDSHAKE);
+	int len = snprintf(hello, RELAY_MAX_HANDSHAKE, "RELAY %u %u %s\n", width, height,
+										 net_get_admin_password());
+	relay_edge_send(hello, len);
+
+	// Deltas queued for a previous connection were dropped with it, and the display may have been
+	// restarted in the meantime. Send everything again.
+	CanvasLayer* layer = canvas_base;
+	memset(layer->changed, 1, (size_t)layer->width * layer->height);
+	memset(layer->changed_tiles, 1, (size_t)layer->tiles_x * layer->tiles_y);
+}
+
+static void relay_edge_connect() {
+	relay_edge.conn = malloc(sizeof(uv_tcp_t));
+	uv_tcp_init(&relay_edge.loop, relay_edge.conn);
+	uv_tcp_nodelay(relay_edge.conn, 1);
+
+	uv_connect_t* req = malloc(sizeof(uv_connect_t));
+	if (uv_tcp_connect(req, relay_edge.conn, (const struct sockaddr*)&relay_edge.addr,
+										 relay_edge_on_connect)) {
+		free(req);
+		relay_edge_disconnect();
+	}
+}
+
+// Append a delta for all changed pixels of a tile to out and clear their change flags. Returns the
+// number of bytes written, or 0 if nothing changed.
+static size_t relay_collect_tile(CanvasLayer* layer, unsigned int tx, unsigned int ty,
+																 uint8_t* out) {
+	unsigned int x0 = tx * CANVAS_TILE_SIZE, y0 = ty * CANVAS_TILE_SIZE;
+	unsigned int w = min(CANVAS_TILE_SIZE, layer->width - x0);
+	unsigned int h = min(CANVAS_TILE_SIZE, layer->height - y0);
+	uint8_t* rec = out + RELAY_HEADER;
+	unsigned int n = 0;
+
+	for (unsigned int y = 0; y < h; y++) {
+		uint8_t* changed = layer->changed + (size_t)(y0 + y) * layer->width + x0;
+		const uint8_t* px = layer->data + (y0 + y) * layer->stride + x0 * layer->bpp;
+
+		for (unsigned int x = 0; x < w; x++) {
+			// Skip unchanged pixels 8 at a time, changes are usually sparse
+			if ((x & 7) == 0 && x + 8 <= w) {
+				uint64_t any;
+				memcpy(&any, changed + x, 8);
+				if (!any) {
+					x += 7;
+					continue;
+				}
+			}
+			if (!changed[x]) continue;
+			changed[x] = 0;
+
+			const uint8_t* p = px + x * layer->bpp;
+			relay_put16(rec, y * CANVAS_TILE_SIZE + x);
+			rec[2] = p[0];
+			rec[3] = p[1];
+			rec[4] = p[2];
+			rec += RELAY_RECORD;
+			n++;
+		}
+	}
+
+	if (n == 0) return 0;
+	memcpy(out, RELAY_MAGIC, 2);
+	relay_put16(out + 2, tx);
+	relay_put16(out + 4, ty);
+	relay_put16(out + 6, n);
+	return RELAY_HEADER + n * RELAY_RECORD;
+}
+
+static void relay_edge_on_timer(uv_timer_t* timer) {
+	if (!relay_edge.connected) {
+		if (!relay_edge.conn && uv_now(&relay_edge.loop) >= relay_edge.next_connect)
+			relay_edge_connect();
+		return;
+	}
+	if (uv_stream_get_write_queue_size((uv_stream_t*)relay_edge.conn) > RELAY_MAX_QUEUE) return;
+
+	CanvasLayer* layer = canvas_base;
+	size_t size = 0, len = 0;
+	uint8_t* out = NULL;
+
+	for (unsigned int t = 0; t < layer->tiles_x * layer->tiles_y; t++) {
+		// The rest stays flagged for the next tick, e.g. after a full resync of a large canvas
+		if (len >= RELAY_MAX_QUEUE) break;
+		if (!layer->changed_tiles[t]) continue;
+		// Clear before scanning, so changes made during the scan flag the tile again
+		layer->changed_tiles[t] = 0;
+
+		if (size - len < RELAY_MAX_DELTA) {
+			size = size ? size * 2 : 16 * RELAY_MAX_DELTA;
+			out = realloc(out, size);
+		}
+		len += relay_collect_tile(layer, t % layer->tiles_x, t / layer->tiles_x, out + len);
+	}
+
+	if (len) {
+		relay_edge_send(out, len);
+	} else {
+		free(out);
+	}
+}
+
+void relay_run_edge(const char* host, int port) {
+	struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+	struct addrinfo* res;
+	char service[16];
+	snprintf(service, sizeof(service), "%d", port);
+	int r = getaddrinfo(host, service, &hints, &res);
+	if (r) {
+		printf("Could not resolve relay display %s: %s\n", host, gai_strerror(r));
+		return;
+	}
+	memcpy(&relay_edge.addr, res->ai_addr, res->ai_addrlen);
+	freeaddrinfo(res);
+
+	canvas_layer_track_changes(canvas_base);
+
+	uv_loop_init(&relay_edge.loop);
+	uv_timer_init(&relay_edge.loop, &relay_edge.timer);
+	uv_timer_start(&relay_edge.timer, relay_edge_on_timer, 0, RELAY_INTERVAL);
+
+	printf("Relaying to display at %s:%d\n", host, port);
+	uv_run(&relay_edge.loop, UV_RUN_DEFAULT);
+}
+
+// Display
+
+typedef struct RelayPeer {
+	uv_tcp_t tcp;
+	// Runs until the handshake is complete
+	uv_timer_t timeout;
+	int handshake;
+	// Number of handles closed so far, the peer is freed once both are
+	int closing;
+	size_t len;
+	size_t size;
+	// RELAY_MAX_HANDSHAKE bytes before the handshake, RELAY_READ_BUFFER bytes after it
+	uint8_t* buf;
+} RelayPeer;
+
+static void relay_peer_on_close(uv_handle_t* handle) {
+	RelayPeer* peer = (RelayPeer*)handle->data;
+	if (++peer->closing < 2) return;
+	free(peer->buf);
+	free(peer);
+}
+
+static void relay_peer_close(RelayPeer* peer) {
+	if (uv_is_closing((uv_handle_t*)&peer->tcp)) return;
+	uv_read_stop((uv_stream_t*)&peer->tcp);
+	uv_close((uv_handle_t*)&peer->tcp, relay_peer_on_close);
+	uv_close((uv_handle_t*)&peer->timeout, relay_peer_on_close);
+}
+
+static void relay_peer_on_timeout(uv_timer_t* timer) {
+	puts("Rejecting relay edge: no handshake");
+	relay_peer_close((RelayPeer*)timer->data);
+}
+
+static void relay_peer_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+	// Read directly behind the data we already have, no copying needed
+	RelayPeer* peer = (RelayPeer*)handle->data;
+	buf->base = (char*)peer->buf + peer->len;
+	buf->len = peer->size - peer->len;
+}
+
+static void relay_apply_delta(const uint8_t* delta, unsigned int n) {
+	// Records are already in the format of canvas_set_tile()
+	canvas_set_tile(relay_get16(delta + 2), relay_get16(delta + 4), delta + RELAY_HEADER, n);
+}
+
+// Consume the handshake and all complete deltas in the buffer. Returns the number of bytes used,
+// or -1 on protocol errors.
+static ssize_t relay_peer_parse(RelayPeer* peer) {
+	uint8_t* p = peer->buf;
+	uint8_t* end = peer->buf + peer->len;
+
+	if (!peer->handshake) {
+		uint8_t* eol = memchr(p, '\n', end - p);
+		if (!eol) return peer->len >= peer->size ? -1 : 0;
+		*eol = '\0';
+
+		unsigned int w, h, width, height;
+		int pos = 0;
+		canvas_get_size(&width, &height);
+		if (sscanf((char*)p, "RELAY %u %u %n", &w, &h, &pos) != 2 || pos == 0) {
+			puts("Rejecting relay edge: invalid handshake");
+			return -1;
+		}
+		if (!net_check_admin_password((char*)p + pos)) {
+			puts("Rejecting relay edge: wrong password");
+			return -1;
+		}
+		if (w != width || h != height) {
+			printf("Rejecting relay edge: canvas size %ux%u, expected %ux%u\n", w, h, width, height);
+			return -1;
+		}
+		peer->handshake = 1;
+		uv_timer_stop(&peer->timeout);
+
+		// Only authenticated edges get a buffer large enough for deltas
+		size_t used = eol + 1 - peer->buf;
+		peer->buf = realloc(peer->buf, RELAY_READ_BUFFER);
+		peer->size = RELAY_READ_BUFFER;
+		p = peer->buf + used;
+		end = peer->buf + peer->len;
+	}
+
+	while (end - p >= RELAY_HEADER) {
+		unsigned int n = relay_get16(p + 6);
+		if (memcmp(p, RELAY_MAGIC, 2) || n > CANVAS_TILE_SIZE * CANVAS_TILE_SIZE) return -1;
+		if ((size_t)(end - p) < RELAY_HEADER + n * RELAY_RECORD) break;
+
+		relay_apply_delta(p, n);
+		p += RELAY_HEADER + n * RELAY_RECORD;
+	}
+
+	return p - peer->buf;
+}
+
+static void relay_peer_on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+	RelayPeer* peer = (RelayPeer*)stream->data;
+
+	if (nread < 0) {
+		if (nread != UV_EOF) printf("Relay edge connection failed: %s\n", uv_strerror(nread));
+		relay_peer_close(peer);
+		return;
+	}
+
+	peer->len += nread;
+	ssize_t used = relay_peer_parse(peer);
+	if (used < 0) {
+		relay_peer_close(peer);
+		return;
+	}
+
+	// Keep the incomplete rest for the next read
+	memmove(peer->buf, peer->buf + used, peer->len - used);
+	peer->len -= used;
+}
+
+static void relay_on_connection(uv_stream_t* server, int status) {
+	if (status < 0) return;
+
+	RelayPeer* peer = malloc(sizeof(RelayPeer));
+	peer->handshake = 0;
+	peer->closing = 0;
+	peer->len = 0;
+	peer->size = RELAY_MAX_HANDSHAKE;
+	peer->buf = malloc(peer->size);
+	uv_tcp_init(server->loop, &peer->tcp);
+	uv_timer_init(server->loop, &peer->timeout);
+	peer->tcp.data = peer;
+	peer->timeout.data = peer;
+
+	if (uv_accept(server, (uv_stream_t*)&peer->tcp) == 0) {
+		printf("Relay edge connected\n");
+		uv_timer_start(&peer->timeout, relay_peer_on_timeout, RELAY_HANDSHAKE_TIMEOUT, 0);
+		uv_read_start((uv_stream_t*)&peer->tcp, relay_peer_alloc, relay_peer_on_read);
+	} else {
+		relay_peer_close(peer);
+	}
+}
+
+static void* relay_display_thread(void* arg) {
+	int port = *(int*)arg;
+	free(arg);
+
+	uv_loop_t loop;
+	uv_tcp_t server;
+	struct sockaddr_in addr;
+	uv_loop_init(&loop);
+	uv_tcp_init(&loop, &server);
+	uv_ip4_addr("0.0.0.0", port, &addr);
+
+	int r = uv_tcp_bind(&server, (const struct sockaddr*)&addr, 0);
+	if (r == 0) r = uv_listen((uv_stream_t*)&server, 16, relay_on_connection);
+	if (r != 0) {
+		printf("Could not listen for relay edges on port %d: %s\n", port, uv_strerror(r));
+		return NULL;
+	}
+
+	printf("Accepting relay edges on port %d\n", port);
+	uv_run(&loop, UV_RUN_DEFAULT);
+	return NULL;
+}
+
+void relay_start_display(int port) {
+	pthread_t thread;
+	int* arg = malloc(sizeof(int));
+	*arg = port;
+	if (pthread_create(&thread, NULL, relay_display_thread, arg)) {
+		printf("Failed to start relay thread\n");
+		exit(1);
+	}
+}
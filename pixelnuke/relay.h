@@ -0,0 +1,18 @@
+#ifndef RELAY_H_
+#define RELAY_H_
+
+// Relay mode: Edge instances terminate client connections, parse and rate-limit their commands
+// and draw to a local canvas without rendering it. Changes are tracked per pixel and streamed as
+// compact tile deltas over a single TCP connection to a display instance, which applies them to
+// its own canvas and renders it. Edges and the display must use the same canvas size and admin
+// password, which authenticates edges.
+
+// Run as an edge: Stream all changes to the base layer to the display instance at host:port.
+// Reconnects if the connection is lost. Blocks forever.
+void relay_run_edge(const char* host, int port);
+
+// Run as a display: Accept edge connections on port and apply their deltas. Runs in a separate
+// thread and returns immediately.
+void relay_start_display(int port);
+
+#endif /* RELAY_H_ */
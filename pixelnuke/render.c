@@ -0,0 +1,89 @@
+#include "render.h"
+
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>	 // usleep
+
+#include "canvas.h"
+
+double render_fps = 0;
+int render_idle = 1;
+
+// Frame statistics. Written by the render thread only, so readers may see slightly torn values.
+static unsigned long render_frames = 0;
+static double render_frame_avg = 0;
+// Except for the maximum since the last canvas_get_frame_stats() call (in nanoseconds), which
+// readers reset. Only accessed atomically, so no frame is lost between reading and resetting it.
+static uint64_t render_frame_max = 0;
+// Average time between two frames, not counting time the render loop spent idle
+static double render_interval_avg = 0;
+static double render_idle_time = 0;
+static double render_last_frame = 0;
+
+double render_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void render_pace(double* next_frame, double period) {
+	double now = render_now();
+	if (*next_frame - now > 0) {
+		usleep((*next_frame - now) * 1000000);
+		*next_frame += period;
+	} else if (now - *next_frame > period) {
+		*next_frame = now + period;
+	} else {
+		*next_frame += period;
+	}
+}
+
+void render_resume(double* next_frame, double since) {
+	double now = render_now();
+	double scheduled = *next_frame > since ? *next_frame : since;
+	if (now > scheduled) render_idle_time += now - scheduled;
+	if (*next_frame < now) *next_frame = now;
+}
+
+void render_frame_done(double seconds) {
+	double now = render_now();
+
+	// Exponential moving averages over roughly the last 64 frames. The frame rate is derived from
+	// the average interval, averaging 1 / interval would let a single short interval dominate it.
+	double interval = now - render_last_frame - render_idle_time;
+	render_idle_time = 0;
+	if (render_frames == 0) {
+		render_frame_avg = seconds;
+	} else {
+		render_frame_avg += (seconds - render_frame_avg) / 64;
+		render_interval_avg += (interval - render_interval_avg) / (render_frames == 1 ? 1 : 64);
+	}
+	uint64_t ns = seconds * 1e9;
+	uint64_t max = __atomic_load_n(&render_frame_max, __ATOMIC_RELAXED);
+	while (ns > max && !__atomic_compare_exchange_n(&render_frame_max, &max, ns, 1, __ATOMIC_RELAXED,
+																									__ATOMIC_RELAXED)) {
+	}
+
+	render_last_frame = now;
+	render_frames++;
+}
+
+unsigned long render_frame_count() { return render_frames; }
+
+// Public functions
+
+void canvas_set_fps(double fps) { render_fps = fps > 0 ? fps : 0; }
+
+void canvas_set_idle(int idle) {
+	render_idle = idle;
+	canvas_backend_wake();
+}
+
+void canvas_get_frame_stats(CanvasFrameStats* stats) {
+	stats->frames = render_frames;
+	stats->frame_avg = render_frame_avg;
+	stats->frame_max = __atomic_exchange_n(&render_frame_max, 0, __ATOMIC_RELAXED) / 1e9;
+	// Frames are not rendered at all while idle, so the average decays towards 0 over time
+	double avg = render_interval_avg;
+	stats->fps = avg > 0 && render_now() - render_last_frame < 1 ? 1 / avg : 0;
+}
@@ -0,0 +1,39 @@
+#ifndef RENDER_H_
+#define RENDER_H_
+
+// Render scheduling and frame time instrumentation shared by all canvas backends.
+// Not part of the public canvas API, see canvas_set_fps() and friends for that.
+
+// Target frame rate, or 0 to render once per display refresh (vsync)
+extern double render_fps;
+// If set, no frames are rendered while the canvas does not change
+extern int render_idle;
+
+// Monotonic time in seconds
+double render_now();
+
+// Sleep until *next_frame, then advance it by one frame period. Called right before rendering a
+// frame. If we fell behind by more than a full frame, the schedule is reset instead of rendering a
+// burst of frames to catch up.
+void render_pace(double* next_frame, double period);
+
+// Called after the render loop slept in idle mode since the given time. The next frame may be
+// rendered right away, but not earlier than scheduled. Time spent idle beyond the schedule does not
+// count towards the frame rate.
+void render_resume(double* next_frame, double since);
+
+// Record the time spent rendering a single frame (excluding any sleep or vsync wait)
+void render_frame_done(double seconds);
+
+// Number of frames rendered so far
+unsigned long render_frame_count();
+
+// Called by the pixel store whenever a clean layer becomes dirty. Implemented by each backend to
+// wake up a render loop that sleeps in idle mode.
+void canvas_backend_wake();
+
+// Request a full redraw of the next frame, even if no layer changed. Used for things drawn on top
+// of the layers, like the heatmap overlay. Thread-safe, implemented by each backend.
+void canvas_backend_redraw();
+
+#endif /* RENDER_H_ */
@@ -0,0 +1,76 @@
+#!/usr/bin/env bash
+# Smoke test for the framebuffer backend: Runs pixelnuke against a fake framebuffer file, draws
+# pixels via TCP (PX, PX2) and UDP (PB) and checks the bytes that end up in the file.
+#
+# Usage: fb_test.sh <path to a pixelnuke binary built with -Dbackend=fb>
+
+set -u
+
+bin=${1:?usage: $0 <pixelnuke binary>}
+dir=$(mktemp -d)
+fb=$dir/fb
+port=$((20000 + RANDOM % 20000))
+udp_port=$((port + 1))
+pid=
+
+cleanup() {
+	[ -n "$pid" ] && kill "$pid" 2>/dev/null && wait "$pid" 2>/dev/null
+	rm -rf "$dir"
+}
+trap cleanup EXIT
+
+fail() {
+	echo "FAIL: $*"
+	echo "--- pixelnuke output (last lines) ---"
+	tail -n 20 "$dir/log"
+	exit 1
+}
+
+# A 32x24 canvas on a 64x48 XRGB8888 framebuffer is scaled by 2, without any offset
+touch "$fb"
+PIXELNUKE_FB=$fb PIXELNUKE_FB_GEOMETRY=64x48x32 PIXELNUKE_ADMIN_PASSWORD=secret \
+	"$bin" --size 32x24 --port "$port" --udp-port "$udp_port" --threads 1 >"$dir/log" 2>&1 &
+pid=$!
+
+for _ in $(seq 50); do
+	{ exec 3<>"/dev/tcp/127.0.0.1/$port"; } 2>/dev/null && break
+	kill -0 "$pid" 2>/dev/null || fail "pixelnuke exited during startup"
+	sleep 0.1
+done
+[ -e /dev/fd/3 ] || fail "could not connect to port $port"
+
+# Bytes at framebuffer pixel (x, y), in memory order (b g r x)
+fb_px() {
+	od -An -tx1 -v -j $((($2 * 64 + $1) * 4)) -N4 "$fb" | tr -d ' \n'
+}
+
+# Wait until canvas pixel (x, y) shows up as the given bytes in all four scaled framebuffer pixels
+expect() {
+	local x=$1 y=$2 want=$3 got
+	for _ in $(seq 50); do
+		got="$(fb_px $((x * 2)) $((y * 2)))$(fb_px $((x * 2 + 1)) $((y * 2 + 1)))"
+		[ "$got" = "$want$want" ] && return 0
+		sleep 0.1
+	done
+	fail "canvas pixel $x $y: expected $want (twice), got $got"
+}
+
+# Base layer
+printf 'PX 3 4 ff8000\n' >&3
+expect 3 4 0080ff00
+
+# Overlay blended over the base layer: 0x80 blue over red
+printf 'PX 5 5 ff0000\nAUTH secret\nPX2 5 5 0000ff80\n' >&3
+expect 5 5 80007f00
+
+# Binary UDP datagram: x, y (uint16, little endian), r, g, b, a. Written with cat, printf flushes
+# at line breaks and would split it into several datagrams.
+printf 'PB\x0a\x00\x02\x00\x11\x22\x33\xff' >"$dir/datagram"
+cat "$dir/datagram" >"/dev/udp/127.0.0.1/$udp_port"
+expect 10 2 33221100
+
+# Untouched pixels stay black
+expect 0 0 00000000
+
+exec 3>&-
+echo "PASS"